@@ -9,6 +9,8 @@
 #define FLAGS_DYNAMIC_DEPTH 1
 #define FLAGS_USE_OPENING_TABLE 2
 #define FLAGS_UCI_MODE 4
+// Generate fully legal moves in the search, instead of pseudo-legal moves checked when they are tried
+#define FLAGS_LEGAL_MOVEGEN 8
 
 #define GAME_UNDETERMINED 0
 #define GAME_DRAW 1
@@ -22,13 +24,30 @@ typedef uint8_t side_t;
 
 /* Engine functions */
 void engine_init(int flags);
+/* Reallocates the transposition table with a size of hashsize megabytes.
+ * The old table is freed first; if the new one cannot be allocated, 1 is returned
+ * and the next search allocates one of the default size (hashmapsize).
+ * Without a call, the first search allocates the default size.
+ */
 int engine_reset_hashmap(int hashsize);
 
+// Saves the transposition table to a file, or replaces it with a saved one
+// (which is mapped into memory, so loading is immediate). Return 1 on failure.
+int engine_save_hashmap(const char* path);
+int engine_load_hashmap(const char* path);
+
+// Size in megabytes of the transposition table of engines created from now on
 extern int hashmapsize;
 
 
 #define ACE_PARAM_CONTEMPT 1
 #define ACE_PARAM_DEBUG 2
+#define ACE_PARAM_THREADS 3
+#define ACE_PARAM_HUGE_PAGES 4 // Back the transposition table with huge pages (on by default, Linux only)
+#define ACE_PARAM_NUMA_INTERLEAVE 5 // Interleave the transposition table over NUMA nodes (Linux only)
+#define ACE_PARAM_MAX_DEPTH 6 // Depth in plies at which searches stop, 0 for the default
+#define ACE_PARAM_MAX_NODES 7 // Number of nodes after which searches stop (roughly), 0 for no limit
+#define ACE_PARAM_MULTIPV 8 // Number of best lines searched and reported in UCI mode (1 to 64)
 int engine_set_param(int name, int value);
 
 void load_evaluation_params();
@@ -37,8 +56,12 @@ void engine_new_game();
 void engine_clear_state();
 char* engine_new_game_from_position(char* position);
 int engine_play();
-int engine_ponder();
 void engine_stop_search();
+/* Clears a stop (and a ponderhit) left over from before, for the next search.
+ * A caller that runs engine_search or engine_ponder on another thread must call it before starting the thread:
+ * a stop that arrives after that is then seen by the search, however soon it comes.
+ */
+void engine_prepare_search();
 int engine_move(char* move);
 struct board* engine_get_board();
 void engine_print();
@@ -47,8 +70,94 @@ unsigned char engine_get_who();
 int engine_won();
 int engine_score();
 int engine_search(char * move, int infinite_mode, int wtime, int btime, int winc, int binc, int moves_to_go);
+/* Searches on the opponent's time, assuming they play the move that the position ends with.
+ * The search has no time limit until engine_ponderhit is called (the opponent played that move),
+ * and then goes on as a timed search with the given clock, counting the time spent pondering.
+ * Returns like engine_search, but only once engine_ponderhit or engine_stop_search has been called.
+ */
+int engine_ponder(char * move, int wtime, int btime, int winc, int binc, int moves_to_go);
+void engine_ponderhit();
+// Copies the reply to the move of the last search that the search expects, to ponder on.
+// Returns 1 if there is none.
+int engine_ponder_move(char * move);
+// Number of nodes searched (over all threads) by the last call to engine_search
+uint64_t engine_nodes();
+
+// Statistics of the last call to engine_search
+struct search_info {
+    uint64_t nodes; // Over all threads
+    int depth; // Last depth completed by the main thread
+    uint64_t tt_hits; // Transposition table hits and probes of the main thread
+    uint64_t tt_probes;
+    int stop_latency; // Milliseconds between engine_stop_search and the end of the search, -1 if it was not stopped
+};
+void engine_search_info(struct search_info* info);
+
+/* Result of a perft run. With PERFT_DETAILS, the captures, en passant captures, castles, promotions
+ * and checks are counted over the moves of the last ply, like the nodes, and with PERFT_EVAL
+ * the positions are evaluated, but both only without a hash table (cached subtrees only hold
+ * their number of nodes, and the flags are then ignored).
+ */
+struct perft_counts {
+    uint64_t nodes;
+    uint64_t captures;
+    uint64_t enpassants;
+    uint64_t castles;
+    uint64_t promotions;
+    uint64_t checks;
+    int64_t eval_score; // Sum of the evaluations of the positions that are not leaves, with PERFT_EVAL and no hash table
+};
+
+// Perft flags
+#define PERFT_DETAILS 1 // Play the moves of the last ply to count their details, instead of only counting them
+#define PERFT_EVAL 2 // Evaluate every position that is not a leaf (ignored with a hash table)
+
+/* Counts the moves from the current position down to depth (at least 1) plies.
+ * By default, only the number of moves is counted, and the moves of the last ply are not played
+ * (bulk counting), so that perft measures the speed of the move generator.
+ * The root moves are shared out among nthreads threads, each with its own copy of the board.
+ * With hash_size megabytes, the node counts of subtrees are cached by position and depth,
+ * so that transpositions are only counted once.
+ * With divide, the number of nodes under every root move is printed as "<move> <nodes>" lines.
+ * Returns 1 if the hash table could not be allocated.
+ */
+int engine_perft(int depth, int nthreads, int hash_size, int flags, int divide, struct perft_counts* counts);
+
+/* Reentrant engine functions.
+ * Every engine_t has its own game state, transposition table and search threads,
+ * so several engines can live in one process without interfering
+ * (each engine must only be used by one thread at a time).
+ * engine_init must have been called once before engine_create.
+ * The functions above operate on a default engine created by engine_init.
+ */
+typedef struct engine engine_t;
 
-void engine_perft(int initial, int depth, side_t who, uint64_t* count, uint64_t* enpassants, uint64_t* captures, uint64_t* check, uint64_t* promotions, uint64_t* castles, int eval, int* eval_score);
+engine_t* engine_create(int flags);
+void engine_destroy(engine_t* engine);
+int engine_reset_hashmap_r(engine_t* engine, int hashsize);
+int engine_save_hashmap_r(engine_t* engine, const char* path);
+int engine_load_hashmap_r(engine_t* engine, const char* path);
+int engine_set_param_r(engine_t* engine, int name, int value);
+void engine_new_game_r(engine_t* engine);
+void engine_clear_state_r(engine_t* engine);
+char* engine_new_game_from_position_r(engine_t* engine, char* position);
+void engine_stop_search_r(engine_t* engine);
+void engine_prepare_search_r(engine_t* engine);
+int engine_move_r(engine_t* engine, char* move);
+struct board* engine_get_board_r(engine_t* engine);
+void engine_print_r(engine_t* engine);
+unsigned char engine_get_who_r(engine_t* engine);
+int engine_won_r(engine_t* engine);
+int engine_score_r(engine_t* engine);
+int engine_search_r(engine_t* engine, char * move, int infinite_mode,
+        int wtime, int btime, int winc, int binc, int moves_to_go);
+int engine_ponder_r(engine_t* engine, char * move, int wtime, int btime, int winc, int binc, int moves_to_go);
+void engine_ponderhit_r(engine_t* engine);
+int engine_ponder_move_r(engine_t* engine, char * move);
+uint64_t engine_nodes_r(engine_t* engine);
+void engine_search_info_r(engine_t* engine, struct search_info* info);
+int engine_perft_r(engine_t* engine, int depth, int nthreads, int hash_size, int flags, int divide,
+        struct perft_counts* counts);
 
 extern int debug_mode;
 
@@ -12,27 +12,46 @@ struct timec {
     int winc;
     int binc;
     int moves_to_go;
+    int ponder;
 };
 
 sem_t available_threads;
 pthread_t search_thread;
 int board_initialized = 0;
 int debug_mode = 0;
+// Set by "go ponder", cleared by "ponderhit" and "stop"
+int pondering = 0;
+
+// In debug mode, reports how long the search took to return after a stop command
+static void print_stop_latency() {
+    struct search_info info;
+    engine_search_info(&info);
+    if (debug_mode && info.stop_latency >= 0)
+        printf("info string stop latency %d ms\n", info.stop_latency);
+}
 
 void * launch_search_thread(void * argument) {
     struct timec* arg = (struct timec *) argument;
-    char buffer[8];
-    engine_search(buffer, 0, arg->wtime, arg->btime, arg->winc, arg->binc, arg->moves_to_go);
-    printf("bestmove %s\n", buffer);
+    char buffer[8], ponder[8];
+    if (arg->ponder)
+        engine_ponder(buffer, arg->wtime, arg->btime, arg->winc, arg->binc, arg->moves_to_go);
+    else
+        engine_search(buffer, 0, arg->wtime, arg->btime, arg->winc, arg->binc, arg->moves_to_go);
+    print_stop_latency();
+    if (engine_ponder_move(ponder) == 0)
+        printf("bestmove %s ponder %s\n", buffer, ponder);
+    else
+        printf("bestmove %s\n", buffer);
     fflush(stdout);
     sem_post(&available_threads);
     return NULL;
 }
 
-void * launch_ponder_thread(void * argument) {
+void * launch_infinite_thread(void * argument) {
     (void) argument;
     char buffer[8];
     engine_search(buffer, 1, 0, 0, 0, 0, 0);
+    print_stop_latency();
     printf("bestmove %s\n", buffer);
     fflush(stdout);
     sem_post(&available_threads);
@@ -50,7 +69,7 @@ int main(int argc, char* argv[]) {
     FILE * f = fopen("log.txt", "a");
 
     engine_init(FLAGS_UCI_MODE | FLAGS_DYNAMIC_DEPTH); // | FLAGS_USE_OPENING_TABLE);
-    engine_reset_hashmap(1 << 26);
+    engine_reset_hashmap(1024);
     while (getline(&buffer, &n, stdin) > 0) {
         fprintf(f, "%s", buffer);
         fflush(f);
@@ -70,18 +89,22 @@ int main(int argc, char* argv[]) {
                 printf("option name Ponder type check default true\n");
                 printf("option name OwnBook type check default true\n");
                 printf("option name Contempt type spin default 0 min -100 max 100\n");
+                printf("option name Threads type spin default 1 min 1 max 64\n");
+                printf("option name MultiPV type spin default 1 min 1 max 64\n");
+                printf("option name HugePages type check default true\n");
+                printf("option name NUMAInterleave type check default false\n");
                 printf("uciok\n");
                 break;
             }
             else if (strcmp(token, "debug") == 0) {
-                // Not implemented
                 token = strtok(NULL, " ");
                 if (token && strcmp(token, "on") == 0) {
                     engine_set_param(ACE_PARAM_DEBUG, 1);
-                    if (debug_mode)
-                        printf("info string debug mode on\n");
+                    debug_mode = 1;
+                    printf("info string debug mode on\n");
                 } else {
                     engine_set_param(ACE_PARAM_DEBUG, 0);
+                    debug_mode = 0;
                 }
                 break;
             }
@@ -98,13 +121,36 @@ int main(int argc, char* argv[]) {
                     if (!token || strcmp(token, "value")) break;
                     token = strtok(NULL, " ");
                     if (!token) break;
-                    engine_reset_hashmap(atoi(token));
+                    if (engine_reset_hashmap(atoi(token)))
+                        printf("info string Could not allocate %s MB of hash\n", token);
                 } else if (strcmp(token, "Contempt") == 0) {
                     token = strtok(NULL, " ");
                     if (!token || strcmp(token, "value")) break;
                     token = strtok(NULL, " ");
                     if (!token) break;
                     engine_set_param(ACE_PARAM_CONTEMPT, atoi(token));
+                } else if (strcmp(token, "Threads") == 0) {
+                    token = strtok(NULL, " ");
+                    if (!token || strcmp(token, "value")) break;
+                    token = strtok(NULL, " ");
+                    if (!token) break;
+                    if (engine_set_param(ACE_PARAM_THREADS, atoi(token)))
+                        printf("info string Invalid number of threads: %s\n", token);
+                } else if (strcmp(token, "MultiPV") == 0) {
+                    token = strtok(NULL, " ");
+                    if (!token || strcmp(token, "value")) break;
+                    token = strtok(NULL, " ");
+                    if (!token) break;
+                    if (engine_set_param(ACE_PARAM_MULTIPV, atoi(token)))
+                        printf("info string Invalid number of lines: %s\n", token);
+                } else if (strcmp(token, "HugePages") == 0 || strcmp(token, "NUMAInterleave") == 0) {
+                    int param = strcmp(token, "HugePages") == 0 ? ACE_PARAM_HUGE_PAGES : ACE_PARAM_NUMA_INTERLEAVE;
+                    token = strtok(NULL, " ");
+                    if (!token || strcmp(token, "value")) break;
+                    token = strtok(NULL, " ");
+                    if (!token) break;
+                    if (engine_set_param(param, strcmp(token, "true") == 0))
+                        printf("info string Could not allocate the hash table\n");
                 }
                 break;
             }
@@ -157,29 +203,29 @@ int main(int argc, char* argv[]) {
                     break;
                 }
                 token = strtok(NULL, " ");
-                if (token != NULL && strcmp(token, "ponder") == 0) {
+                if (token != NULL && strcmp(token, "infinite") == 0) {
                     engine_stop_search();
                     sem_wait(&available_threads);
-                    pthread_create(&search_thread, NULL, launch_ponder_thread, NULL);
-                    pthread_detach(search_thread);
-                    break;
-                } else if (token != NULL && strcmp(token, "infinite") == 0) {
-                    engine_stop_search();
-                    sem_wait(&available_threads);
-                    pthread_create(&search_thread, NULL, launch_ponder_thread, NULL);
+                    engine_prepare_search();
+                    pthread_create(&search_thread, NULL, launch_infinite_thread, NULL);
                     pthread_detach(search_thread);
                     break;
                 }
 
-                struct timec timec;
+                // Read by the search thread, which starts before the next command is parsed
+                static struct timec timec;
                 timec.wtime = 8000;
                 timec.btime = 8000;
                 timec.winc = 0;
                 timec.binc = 0;
                 timec.moves_to_go = 0;
+                timec.ponder = 0;
 
                 while (token != NULL) {
-                    if (strcmp(token, "wtime") == 0) {
+                    if (strcmp(token, "ponder") == 0) {
+                        timec.ponder = 1;
+                    }
+                    else if (strcmp(token, "wtime") == 0) {
                         token = strtok(NULL, " ");
                         if (token) {
                             timec.wtime = atoi(token);
@@ -221,6 +267,9 @@ int main(int argc, char* argv[]) {
                 }
                 engine_stop_search();
                 sem_wait(&available_threads);
+                // Before the thread starts, so that a stop right after the go is not lost
+                engine_prepare_search();
+                pondering = timec.ponder;
                 pthread_create(&search_thread, NULL, launch_search_thread, &timec);
                 pthread_detach(search_thread);
                 break;
@@ -228,7 +277,25 @@ int main(int argc, char* argv[]) {
             else if (strcmp(token, "eath") == 0) {
                 break;
             }
+            else if (strcmp(token, "savehash") == 0 || strcmp(token, "loadhash") == 0) {
+                // Non-standard commands: savehash <file>, loadhash <file>
+                int save = strcmp(token, "savehash") == 0;
+                token = strtok(NULL, "");
+                if (!token) {
+                    printf("info string missing file name\n");
+                    break;
+                }
+                engine_stop_search();
+                sem_wait(&available_threads);
+                if (save ? engine_save_hashmap(token) : engine_load_hashmap(token))
+                    printf("info string could not %s hash file %s\n", save ? "save" : "load", token);
+                else
+                    printf("info string %s hash file %s\n", save ? "saved" : "loaded", token);
+                sem_post(&available_threads);
+                break;
+            }
             else if (strcmp(token, "stop") == 0) {
+                pondering = 0;
                 if (board_initialized)
                     engine_stop_search();
                 else
@@ -236,6 +303,9 @@ int main(int argc, char* argv[]) {
                 break;
             }
             else if (strcmp(token, "ponderhit") == 0) {
+                if (pondering)
+                    engine_ponderhit();
+                pondering = 0;
                 break;
             }
             else if (strcmp(token, "quit") == 0) {
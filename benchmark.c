@@ -1,14 +1,12 @@
-/* Chess Engine
- * Protocol:
- * W/B (if engine is White or Black)
- * n: number of moves to play in advance
- * 2*n lines of moves
- * white's move if engine is Black
- * Engine outputs move to standard out
+/* Search benchmark.
+ * Searches a fixed set of positions (openings, middlegames, endgames and tactical positions)
+ * to a fixed depth, or with a fixed node budget per position, starting every position
+ * with empty tables. It prints the total nodes, the speed, the average branching factor,
+ * the transposition table hit rate, and a signature of the node counts of all the positions:
+ * with one thread, the search is deterministic, so any change of the signature means
+ * that the search behaves differently.
  *
- * Components:
- * board.c: manages the board, parser for moves, move output
- * suggest.c: suggests a move to take
+ * With --game, it plays 20 moves from the starting position instead, as it used to.
  */
 
 #include <stdio.h>
@@ -16,22 +14,214 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <math.h>
 
 #include "ace.h"
+#include "util.h"
 
-int main(int argc, char* argv[]) {
-    int i = 0;
+static struct option long_options[] = {
+    {"threads",  required_argument, 0, 't'},
+    {"no-huge-pages", no_argument,  0, 'p'},
+    {"numa",     no_argument,       0, 'm'},
+    {"legal",    no_argument,       0, 'l'},
+    {"depth",    required_argument, 0, 'd'},
+    {"nodes",    required_argument, 0, 'n'},
+    {"hash",     required_argument, 0, 'H'},
+    {"game",     no_argument,       0, 'g'},
+    {0, 0, 0, 0}
+};
+
+static char* bench_positions[] = {
+    // Openings and middlegames
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r1bq1rk1/pp2ppbp/2np1np1/8/3NP3/2N1BP2/PPPQ2PP/R3KB1R w KQ - 3 9",
+    "r2q1rk1/pp1bbppp/2n1pn2/3p4/2PP4/2NBPN2/PP3PPP/R2Q1RK1 w - - 0 10",
+    "2rq1rk1/pp1bppbp/3p1np1/4n3/3NP2P/1BN1BP2/PPPQ2P1/2KR3R b - - 0 13",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r1bqk2r/pppp1ppp/2n2n2/2b1p3/2B1P3/3P1N2/PPP2PPP/RNBQK2R w KQkq - 1 5",
+    "rnbqkb1r/ppp2ppp/4pn2/3p4/2PP4/2N5/PP2PPPP/R1BQKBNR w KQkq - 2 4",
+    "rnbqk2r/ppp1bppp/4pn2/3p2B1/2PP4/2N5/PP2PPPP/R2QKBNR w KQkq - 4 5",
+    "r1bqkb1r/1p3ppp/p1nppn2/6B1/3NP3/2N5/PPP2PPP/R2QKB1R w KQkq - 0 8",
+    "rnbqk2r/ppp2ppp/3bpn2/3p4/2PP4/2N1PN2/PP3PPP/R1BQKB1R b KQkq - 0 5",
+    "r1bq1rk1/ppp1bppp/2n1pn2/3p4/2PP4/2NBPN2/PP3PPP/R1BQ1RK1 w - - 5 7",
+    "r2qkb1r/pp2nppp/3p4/2pNN1B1/2BnP3/3P4/PPP2PPP/R2bK2R w KQkq - 1 10",
+    "2r3k1/1q1nbppp/r3p3/3pP3/pPpP4/P1Q2N2/2RN1PPP/2R4K b - - 0 23",
+    "r1b2rk1/2q1b1pp/p2ppn2/1p6/3QP3/1BN1B3/PPP3PP/R4RK1 w - - 0 15",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/p2bb2p/1p1p2p1/2pPp2n/2P1PpP1/2N2P2/PP1B2BP/R2QR1K1 b - - 0 19",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4k2r/1pb2Bp1/2p5/2N1p3/4P3/1P5P/r1P2RP1/2KR4 b k - 0 24",
+    // Endgames
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/8/1p1k4/2p1p3/2P1P3/1P1K4/8/8 w - - 0 1",
+    "8/8/8/4k3/8/8/4PK2/8 w - - 0 1",
+    "8/k7/3p4/p2P1p2/P2P1P2/8/8/K7 w - - 0 1",
+    "8/3k4/8/8/3K4/8/3P4/8 w - - 0 1",
+    "8/8/3p4/1r1k4/3P1p2/5P2/3K1R2/8 w - - 0 1",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+    "8/5pk1/6p1/3P4/7P/5K2/8/8 w - - 0 1",
+    "8/8/4kpp1/3p1b2/p6P/2B5/6P1/6K1 b - - 2 48",
+    "2k5/8/1pP1K3/1P6/8/8/8/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "8/2r3k1/8/5P2/6K1/8/8/1R6 w - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "2r2rk1/1bqnbpp1/1p1ppn1p/pP6/N1P1P3/P2B1N1P/1B2QPP1/R2R2K1 b - - 0 1",
+    // Tactical positions
+    "r1bq2rk/pp3pbp/2p1p1pQ/7P/3P4/2PB1N2/PP3PPR/2KR4 w - - 0 1",
+    "r4r1k/1bpq1p1n/p1np4/1p1Bb1BQ/P7/6R1/1P3PPP/1N2R1K1 w - - 0 1",
+    "2kr3r/pp1q1ppp/5n2/1Nb5/2Pp1B2/7Q/P4PPP/1R3RK1 w - - 0 1",
+    "1k1r4/pp1b1R2/3q2pp/4p3/2B5/4Q3/PPP2B2/2K5 b - - 0 1",
+    "3r1k2/4npp1/1ppr3p/p6P/P2PPPP1/1NR5/5K2/2R5 w - - 0 1",
+    "r1b1kb1r/pppp1ppp/5q2/4n3/3KP3/2N3PN/PPP4P/R1BQ1B1R b kq - 0 1",
+    "2r1nrk1/p2q1ppp/bp1p4/n1pPp3/P1P1P3/2PBB1N1/4QPPP/R4RK1 w - - 0 1",
+};
+
+#define NPOSITIONS (sizeof(bench_positions) / sizeof(bench_positions[0]))
+
+// Wall clock time in milliseconds; clock() would add up the CPU time of all search threads
+static uint64_t wall_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
 
-    engine_init(0);
-    engine_reset_hashmap(1 << 26);
-    clock_t start = clock();
+static void run_game() {
+    uint64_t nodes = 0;
+    uint64_t start = wall_time_ms();
     engine_new_game();
-    for (i = 0; i < 20; i++) {
+    for (int i = 0; i < 20; i++) {
         printf("Move %d\n", i);
         char move[8];
+        uint64_t move_start = wall_time_ms();
         engine_search(move, 1, 0, 0, 0, 0, 0);
+        nodes += engine_nodes();
+        printf("Time to depth: %llu milliseconds\n", (unsigned long long) (wall_time_ms() - move_start));
         engine_move(move);
     }
-    clock_t end = clock();
-    printf("Time: %lu milliseconds\n", (end - start) * 1000 / CLOCKS_PER_SEC);
+    uint64_t elapsed = MAX(wall_time_ms() - start, 1);
+    printf("Time: %llu milliseconds\n", (unsigned long long) elapsed);
+    printf("Nodes: %llu (%llu nodes/sec)\n", (unsigned long long) nodes, (unsigned long long) (nodes * 1000 / elapsed));
+}
+
+static void run_bench() {
+    uint64_t nodes = 0, tt_hits = 0, tt_probes = 0;
+    uint64_t signature = 0xcbf29ce484222325ull; // FNV-1a hash of the node counts
+    uint64_t elapsed = 0;
+    double branching = 0;
+    for (unsigned i = 0; i < NPOSITIONS; i++) {
+        char move[8];
+        struct search_info info;
+        engine_new_game_from_position(bench_positions[i]);
+        engine_clear_state();
+        uint64_t start = wall_time_ms();
+        engine_search(move, 1, 0, 0, 0, 0, 0);
+        uint64_t time = wall_time_ms() - start;
+        engine_search_info(&info);
+        printf("Position %2u: depth %2d, %10llu nodes, %5llu ms, best move %s\n", i + 1, info.depth,
+                (unsigned long long) info.nodes, (unsigned long long) time, move);
+        elapsed += time;
+        nodes += info.nodes;
+        tt_hits += info.tt_hits;
+        tt_probes += info.tt_probes;
+        // Effective branching factor: the number of nodes is about b^depth
+        branching += pow(info.nodes, 1.0 / MAX(info.depth, 1));
+        for (int b = 0; b < 8; b++) {
+            signature ^= (info.nodes >> (8 * b)) & 0xff;
+            signature *= 0x100000001b3ull;
+        }
+    }
+    elapsed = MAX(elapsed, 1);
+    printf("===========================\n");
+    printf("Positions: %u\n", (unsigned) NPOSITIONS);
+    printf("Time: %llu milliseconds\n", (unsigned long long) elapsed);
+    printf("Nodes: %llu\n", (unsigned long long) nodes);
+    printf("Nodes/sec: %llu\n", (unsigned long long) (nodes * 1000 / elapsed));
+    printf("Average branching factor: %.2f\n", branching / NPOSITIONS);
+    printf("TT hit rate: %.2f%%\n", tt_probes ? 100.0 * tt_hits / tt_probes : 0);
+    printf("Signature: %016llx\n", (unsigned long long) signature);
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    int threads = 1;
+    int huge_pages = 1;
+    int numa = 0;
+    int flags = 0;
+    int depth = 8;
+    int max_nodes = 0;
+    int hash_size = 64;
+    int game = 0;
+    while (1) {
+        int option_index = 0;
+        c = getopt_long(argc, argv, "t:pmld:n:H:g", long_options, &option_index);
+
+        if (c == -1)
+            break;
+        switch (c) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'p':
+                huge_pages = 0;
+                break;
+            case 'm':
+                numa = 1;
+                break;
+            case 'l':
+                flags |= FLAGS_LEGAL_MOVEGEN;
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'n':
+                // A node budget replaces the depth limit
+                max_nodes = atoi(optarg);
+                depth = 0;
+                break;
+            case 'H':
+                hash_size = atoi(optarg);
+                break;
+            case 'g':
+                game = 1;
+                break;
+            case '?':
+                break;
+
+            default:
+                abort ();
+          }
+    }
+
+    engine_init(flags);
+    if (engine_set_param(ACE_PARAM_THREADS, threads)) {
+        fprintf(stderr, "Invalid number of threads: %d\n", threads);
+        exit(1);
+    }
+    engine_set_param(ACE_PARAM_HUGE_PAGES, huge_pages);
+    engine_set_param(ACE_PARAM_NUMA_INTERLEAVE, numa);
+    uint64_t alloc_start = wall_time_ms();
+    engine_reset_hashmap(game ? 2048 : hash_size);
+    printf("Hash allocation: %llu milliseconds\n", (unsigned long long) (wall_time_ms() - alloc_start));
+    printf("Threads: %d\n", threads);
+    if (game) {
+        run_game();
+        return 0;
+    }
+    if (threads > 1)
+        printf("The signature is only reproducible with one thread\n");
+    engine_set_param(ACE_PARAM_MAX_DEPTH, depth);
+    engine_set_param(ACE_PARAM_MAX_NODES, max_nodes);
+    run_bench();
+    return 0;
 }
@@ -25,25 +25,26 @@ int board_npieces(struct board* board, side_t who) {
 }
 
 char get_piece_on_square(struct board* board, int square) {
-    side_t who;
-    uint64_t mask = (1ull << square);
-    for (who = 0; who < 2; who++) {
-        if (mask & board->pieces[who][PAWN])
-            return (who * 6 + PAWN);
-        else if (mask & board->pieces[who][KNIGHT])
-            return (who * 6 + KNIGHT);
-        else if (mask & board->pieces[who][BISHOP])
-            return (who * 6 + BISHOP);
-        else if (mask & board->pieces[who][ROOK])
-            return (who * 6 + ROOK);
-        else if (mask & board->pieces[who][QUEEN])
-            return (who * 6 + QUEEN);
-        else if (mask & board->pieces[who][KING])
-            return (who * 6 + KING);
-    }
-    return -1;
+    return board->mailbox[square];
 }
 
+#ifdef DEBUG
+// Aborts if the mailbox does not match the bitmaps
+static void board_check_mailbox(struct board* board) {
+    for (int square = 0; square < 64; square++) {
+        char piece = -1;
+        for (int i = 0; i < 12; i++) {
+            if (P2BM(board, i) & (1ull << square))
+                piece = i;
+        }
+        if (piece != board->mailbox[square]) {
+            fprintf(stderr, "Mailbox holds %d on square %d instead of %d\n", board->mailbox[square], square, piece);
+            abort();
+        }
+    }
+}
+#endif
+
 int move_equal(move_t m1, move_t m2) {
     // We just need the first 6 bytes to be equal
     uint64_t m1p, m2p;
@@ -165,6 +166,34 @@ int is_pseudo_valid_move(struct board* board, side_t who, struct delta move) {
     return 1;
 }
 
+/* Checks that a pseudo-legal move does not leave the king of the side to move in check.
+ * The side to move must not be in check (pseudo-legal generation only happens outside of check),
+ * and castling moves are only generated when they are legal.
+ * Only king moves, en-passant captures and moves of pieces on a line from the king can be illegal,
+ * so most moves are accepted with a single table lookup.
+ */
+int is_legal(struct board* board, move_t* move) {
+    side_t who = board->who;
+    uint64_t from = 1ull << move->square1;
+    uint64_t to = 1ull << move->square2;
+    if (move->piece != KING && !(move->misc & 0x40) && !(attack_set_queen(board->kingsq[who], 0, 0) & from))
+        return 1;
+    if (move->misc & 0x80)
+        return 1;
+
+    uint64_t friendly_occupancy = board_occupancy(board, who);
+    uint64_t enemy_occupancy = board_occupancy(board, 1 - who);
+    if (move->piece == KING) {
+        return !is_attacked(board, 0, (friendly_occupancy | enemy_occupancy) ^ from, 1 - who, move->square2);
+    }
+    if (move->misc & 0x40) {
+        return !is_in_check_slider(board, who, friendly_occupancy ^ from ^ to, enemy_occupancy ^ board->enpassant);
+    }
+    // The piece might be pinned: check for a slider attack along the line it leaves.
+    // A slider captured on the destination square does not attack anymore.
+    return !(is_in_check_slider(board, who, friendly_occupancy ^ from ^ to, enemy_occupancy & ~to) & ~to);
+}
+
 uint64_t board_flip_side(struct board* board, uint64_t enpassant) {
     uint64_t old_enpassant = board->enpassant;
     if (old_enpassant != 1) {
@@ -185,7 +214,9 @@ int apply_move(struct board* board, struct delta* move) {
     move->enpassant = LSBINDEX(board->enpassant);
     move->cancastle = board->cancastle;
     move->misc &= 0xc0;
-    move->misc |= board->nmovesnocapture;
+    // Only 6 bits are left for the clock: a longer one must not spill into the flags of the move,
+    // which is applied again when it is kept (root moves, principal variations)
+    move->misc |= board->nmovesnocapture & 0x3f;
     board->who = 1 - board->who;
 
     if (board->enpassant != 1) hupdate ^= enpassant_hash_codes[move->enpassant % 8];
@@ -195,11 +226,16 @@ int apply_move(struct board* board, struct delta* move) {
 
     board->pieces[who][move->promotion] ^= mask2;
     board->pieces[who][move->piece] ^= mask1;
+    board->mailbox[move->square1] = -1;
+    board->mailbox[move->square2] = 6 * who + move->promotion;
     board->nmoves += 1;
     board->nmovesnocapture += who;
 
     hupdate ^= square_hash_codes[move->square1][6 * who + move->piece];
     hupdate ^= square_hash_codes[move->square2][6 * who + move->promotion];
+    board->material_pst += material_pst_table[6 * who + move->promotion][move->square2] -
+        material_pst_table[6 * who + move->piece][move->square1];
+    board->game_phase += move->promotion != move->piece;
 
     if (move->piece == PAWN) {
         board->pawn_hash ^= square_hash_codes[move->square1][6 * who + move->piece];
@@ -218,13 +254,17 @@ int apply_move(struct board* board, struct delta* move) {
             // En passant
             board->pieces[1-who][move->captured] ^= board->enpassant;
             hupdate ^= square_hash_codes[move->enpassant][6 * (1-who) + move->captured];
+            board->material_pst -= material_pst_table[6 * (1-who) + move->captured][move->enpassant];
+            board->mailbox[move->enpassant] = -1;
             move->misc |= 0x40;
         }
         else {
             board->pieces[1-who][move->captured] ^= mask2;
             hupdate ^= square_hash_codes[move->square2][6 * (1-who) + move->captured];
+            board->material_pst -= material_pst_table[6 * (1-who) + move->captured][move->square2];
             board->cancastle &= castle_priv[move->square2];
         }
+        board->game_phase -= move->captured != PAWN;
         board->nmovesnocapture = 0;
         if (move->captured == PAWN) {
             board->pawn_hash ^= square_hash_codes[move->square2][6 * (1-who) + move->captured];
@@ -253,9 +293,17 @@ int apply_move(struct board* board, struct delta* move) {
         if (file2 == 2) {
             board->pieces[who][ROOK] ^= (0x09ull << (rank2 * 8));
             hupdate ^= square_hash_codes[who ? 56 : 0][6 * who + ROOK] ^ square_hash_codes[who ? 59 : 3][6 * who + ROOK];
+            board->material_pst += material_pst_table[6 * who + ROOK][rank2 * 8 + 3] -
+                material_pst_table[6 * who + ROOK][rank2 * 8];
+            board->mailbox[rank2 * 8] = -1;
+            board->mailbox[rank2 * 8 + 3] = 6 * who + ROOK;
         } else {
             board->pieces[who][ROOK] ^= (0xa0ull << (rank2 * 8));
             hupdate ^= square_hash_codes[who ? 63 : 7][6 * who + ROOK] ^ square_hash_codes[who ? 61 : 5][6 * who + ROOK];
+            board->material_pst += material_pst_table[6 * who + ROOK][rank2 * 8 + 5] -
+                material_pst_table[6 * who + ROOK][rank2 * 8 + 7];
+            board->mailbox[rank2 * 8 + 7] = -1;
+            board->mailbox[rank2 * 8 + 5] = 6 * who + ROOK;
         }
     }
 
@@ -278,6 +326,10 @@ int apply_move(struct board* board, struct delta* move) {
 
     board->hash ^= hupdate;
 
+#ifdef DEBUG
+    board_check_material_pst(board);
+    board_check_mailbox(board);
+#endif
     return 0;
 }
 
@@ -297,6 +349,11 @@ int reverse_move(struct board* board, move_t* move) {
     uint64_t mask2 = (1ull << move->square2);
     board->pieces[who][move->promotion] ^= mask2;
     board->pieces[who][move->piece] ^= mask1;
+    board->material_pst -= material_pst_table[6 * who + move->promotion][move->square2] -
+        material_pst_table[6 * who + move->piece][move->square1];
+    board->game_phase -= move->promotion != move->piece;
+    board->mailbox[move->square1] = 6 * who + move->piece;
+    board->mailbox[move->square2] = -1;
     if (move->piece == PAWN) {
         board->pawn_hash ^= square_hash_codes[move->square1][6 * who + move->piece];
         if (move->promotion == PAWN) {
@@ -313,9 +370,15 @@ int reverse_move(struct board* board, move_t* move) {
         if (move->misc & 0x40) {
             // En passant
             board->pieces[1-who][move->captured] ^= board->enpassant;
+            board->material_pst += material_pst_table[6 * (1-who) + move->captured][move->enpassant];
+            board->mailbox[move->enpassant] = 6 * (1-who) + move->captured;
         }
-        else
+        else {
             board->pieces[1-who][move->captured] ^= mask2;
+            board->material_pst += material_pst_table[6 * (1-who) + move->captured][move->square2];
+            board->mailbox[move->square2] = 6 * (1-who) + move->captured;
+        }
+        board->game_phase += move->captured != PAWN;
         if (move->captured == PAWN) {
             board->pawn_hash ^= square_hash_codes[move->square2][6 * (1-who) + move->captured];
         }
@@ -327,11 +390,23 @@ int reverse_move(struct board* board, move_t* move) {
         int file2 = move->square2 % 8;
         if (file2 == 2) {
             board->pieces[who][ROOK] ^= (0x09ull << (rank2 * 8));
+            board->material_pst -= material_pst_table[6 * who + ROOK][rank2 * 8 + 3] -
+                material_pst_table[6 * who + ROOK][rank2 * 8];
+            board->mailbox[rank2 * 8 + 3] = -1;
+            board->mailbox[rank2 * 8] = 6 * who + ROOK;
         } else {
             board->pieces[who][ROOK] ^= (0xa0ull << (rank2 * 8));
+            board->material_pst -= material_pst_table[6 * who + ROOK][rank2 * 8 + 5] -
+                material_pst_table[6 * who + ROOK][rank2 * 8 + 7];
+            board->mailbox[rank2 * 8 + 5] = -1;
+            board->mailbox[rank2 * 8 + 7] = 6 * who + ROOK;
         }
     }
 
+#ifdef DEBUG
+    board_check_material_pst(board);
+    board_check_mailbox(board);
+#endif
     return 0;
 }
 
@@ -399,18 +474,8 @@ static void deltaset_add_move(struct board* board, side_t who, struct deltaset *
                 out->moves[i].square2 = square2;
                 out->moves[i].square1 = square1;
 
-                if (mask2 & enemy) {
-                    if (mask2 & board->pieces[1 - who][PAWN])
-                        out->moves[i].captured = PAWN;
-                    else if (mask2 & board->pieces[1 - who][KNIGHT])
-                        out->moves[i].captured = KNIGHT;
-                    else if (mask2 & board->pieces[1 - who][BISHOP])
-                        out->moves[i].captured = BISHOP;
-                    else if (mask2 & board->pieces[1 - who][ROOK])
-                        out->moves[i].captured = ROOK;
-                    else if (mask2 & board->pieces[1 - who][QUEEN])
-                        out->moves[i].captured = QUEEN;
-                }
+                if (mask2 & enemy)
+                    out->moves[i].captured = board->mailbox[square2] - 6 * (1 - who);
 
                 i++;
             }
@@ -423,16 +488,7 @@ static void deltaset_add_move(struct board* board, side_t who, struct deltaset *
             out->moves[i].square1 = square1;
 
             if (mask2 & enemy) {
-                if (mask2 & board->pieces[1 - who][PAWN])
-                    out->moves[i].captured = PAWN;
-                else if (mask2 & board->pieces[1 - who][KNIGHT])
-                    out->moves[i].captured = KNIGHT;
-                else if (mask2 & board->pieces[1 - who][BISHOP])
-                    out->moves[i].captured = BISHOP;
-                else if (mask2 & board->pieces[1 - who][ROOK])
-                    out->moves[i].captured = ROOK;
-                else if (mask2 & board->pieces[1 - who][QUEEN])
-                    out->moves[i].captured = QUEEN;
+                out->moves[i].captured = board->mailbox[square2] - 6 * (1 - who);
             } else if (piece == PAWN && (square2 - square1) % 8 != 0) {
                 // En-passant
                 out->moves[i].captured = PAWN;
@@ -457,6 +513,38 @@ static void deltaset_add_castle(struct deltaset *out, int square1, int square2)
     out->nmoves += 1;
 }
 
+// Adds the castling moves allowed by the castling rights, the occupancy and the squares attacked by the opponent
+static void deltaset_add_castles(struct deltaset *mvs, struct board* board, side_t who, int kingsquare,
+        uint64_t occupancy, uint64_t opponent_attacks) {
+    if (who) {
+        // Black queenside
+        if ((board->cancastle & CASTLE_PRIV_BQ) &&
+                !(0x0e00000000000000ull & occupancy) &&
+                !(0x1c00000000000000ull & opponent_attacks)) {
+            deltaset_add_castle(mvs, kingsquare, 58);
+        }
+        // Black kingside
+        if ((board->cancastle & CASTLE_PRIV_BK) &&
+                !(0x6000000000000000ull & occupancy) &&
+                !(0x7000000000000000ull & opponent_attacks)) {
+            deltaset_add_castle(mvs, kingsquare, 62);
+        }
+    } else {
+        // White queenside;
+        if ((board->cancastle & CASTLE_PRIV_WQ) &&
+                !(0x000000000000000eull & occupancy) &&
+                !(0x000000000000001cull & opponent_attacks)) {
+            deltaset_add_castle(mvs, kingsquare, 2);
+        }
+        // White kingside
+        if ((board->cancastle & CASTLE_PRIV_WK) &&
+                !(0x0000000000000060ull & occupancy) &&
+                !(0x0000000000000070ull & opponent_attacks)) {
+            deltaset_add_castle(mvs, kingsquare, 6);
+        }
+    }
+}
+
 void generate_moves(struct deltaset* mvs, struct board* board) {
     uint64_t temp, square;
     uint64_t attack, opponent_attacks;
@@ -469,6 +557,7 @@ void generate_moves(struct deltaset* mvs, struct board* board) {
 
     mvs->nmoves = 0;
     mvs->check = 0;
+    mvs->pseudo = 0;
     mvs->who = who;
     mvs->my_attacks = 0;
 
@@ -567,12 +656,13 @@ void generate_moves(struct deltaset* mvs, struct board* board) {
             attack = attack_set_pawn[who](square, board->enpassant, friendly_occupancy, enemy_occupancy);
         }
         // Special case: attacker is an advanced by two pawn,
-        // which can be captured en passant
+        // which can be captured en passant.
+        // Only the square behind it is added: mask also holds the king square.
         if ((check & board->enpassant) && board->enpassant != 1) {
             if (who)
-                attack &= (mask | (mask >> 8));
+                attack &= (mask | (board->enpassant >> 8));
             else
-                attack &= (mask | (mask << 8));
+                attack &= (mask | (board->enpassant << 8));
         } else {
             attack &= mask;
         }
@@ -611,35 +701,8 @@ void generate_moves(struct deltaset* mvs, struct board* board) {
     attack = ~opponent_attacks & attack;
     deltaset_add_move(board, who, mvs, KING, kingsquare, attack, friendly_occupancy, enemy_occupancy, 5);
     mvs->my_attacks |= attack;
-    
-    // Castling
-    if (who) {
-        // Black queenside
-        if ((board->cancastle & CASTLE_PRIV_BQ) &&
-                !(0x0e00000000000000ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x1c00000000000000ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 58);
-        }
-        // Black kingside
-        if ((board->cancastle & CASTLE_PRIV_BK) &&
-                !(0x6000000000000000ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x7000000000000000ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 62);
-        }
-    } else {
-        // White queenside;
-        if ((board->cancastle & CASTLE_PRIV_WQ) &&
-                !(0x000000000000000eull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x000000000000001cull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 2);
-        }
-        // White kingside
-        if ((board->cancastle & CASTLE_PRIV_WK) &&
-                !(0x0000000000000060ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x0000000000000070ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 6);
-        }
-    }
+
+    deltaset_add_castles(mvs, board, who, kingsquare, friendly_occupancy | enemy_occupancy, opponent_attacks);
 }
 
 void generate_qsearch_moves(struct deltaset* mvs, struct board* board) {
@@ -657,35 +720,8 @@ void generate_qsearch_moves(struct deltaset* mvs, struct board* board) {
     }
 
     generate_captures(mvs, board);
-    
-    // Castling
-    if (who) {
-        // Black queenside
-        if ((board->cancastle & CASTLE_PRIV_BQ) &&
-                !(0x0e00000000000000ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x1c00000000000000ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 58);
-        }
-        // Black kingside
-        if ((board->cancastle & CASTLE_PRIV_BK) &&
-                !(0x6000000000000000ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x7000000000000000ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 62);
-        }
-    } else {
-        // White queenside;
-        if ((board->cancastle & CASTLE_PRIV_WQ) &&
-                !(0x000000000000000eull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x000000000000001cull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 2);
-        }
-        // White kingside
-        if ((board->cancastle & CASTLE_PRIV_WK) &&
-                !(0x0000000000000060ull & (friendly_occupancy | enemy_occupancy)) &&
-                !(0x0000000000000070ull & opponent_attacks)) {
-            deltaset_add_castle(mvs, kingsquare, 6);
-        }
-    }
+
+    deltaset_add_castles(mvs, board, who, kingsquare, friendly_occupancy | enemy_occupancy, opponent_attacks);
 }
 
 void generate_captures(struct deltaset* mvs, struct board* board) {
@@ -701,6 +737,7 @@ void generate_captures(struct deltaset* mvs, struct board* board) {
 
     mvs->nmoves = 0;
     mvs->check = 0;
+    mvs->pseudo = 0;
     mvs->who = who;
     mvs->my_attacks = 0;
 
@@ -810,3 +847,139 @@ void generate_captures(struct deltaset* mvs, struct board* board) {
     deltaset_add_move(board, who, mvs, KING, kingsquare, attack, friendly_occupancy, enemy_occupancy, 2);
 }
 
+
+/* Pieces of who that are pinned to their king: only these (and the king) can make a pseudo-legal move
+ * that leaves the king in check. The evaluation also needs them for mobility.
+ */
+static uint64_t pinned_pieces(struct board* board, side_t who, int kingsquare,
+        uint64_t friendly_occupancy, uint64_t enemy_occupancy) {
+    uint64_t xray_rook = xray_rook_attacks(kingsquare, friendly_occupancy | enemy_occupancy, friendly_occupancy);
+    uint64_t xray_bishop = xray_bishop_attacks(kingsquare, friendly_occupancy | enemy_occupancy, friendly_occupancy);
+    uint64_t pinners = (xray_bishop & (board->pieces[1-who][BISHOP] | board->pieces[1-who][QUEEN])) |
+                       (xray_rook & (board->pieces[1-who][ROOK] | board->pieces[1-who][QUEEN]));
+    uint64_t pinned = 0;
+    uint64_t pintemp;
+    int pinsq;
+    bmloop(pinners, pinsq, pintemp) {
+        pinned |= ray_between(kingsquare, pinsq);
+    }
+    return friendly_occupancy & pinned;
+}
+
+/* Pseudo-legal move generation: like generate_moves, except that pinned pieces move freely
+ * and the king may move to attacked squares, so every move has to be checked with is_legal before it is played.
+ * This skips the attack maps and the pin masks, which are wasted work when the first move tried cuts off.
+ * The squares attacked by the opponent are only computed if castling is possible,
+ * and opponent_attacks, undefended_squares and my_attacks are left empty.
+ * In check, the legal evasions are generated instead (see generate_moves) and mvs->pseudo is cleared.
+ */
+void generate_pseudo_moves(struct deltaset* mvs, struct board* board) {
+    uint64_t temp, square;
+    uint64_t attack;
+    side_t who = board->who;
+    uint64_t friendly_occupancy = board_occupancy(board, who);
+    uint64_t enemy_occupancy = board_occupancy(board, 1 - who);
+    int kingsquare = board->kingsq[who];
+
+    if (is_in_check(board, who, friendly_occupancy, enemy_occupancy)) {
+        generate_moves(mvs, board);
+        return;
+    }
+
+    mvs->nmoves = 0;
+    mvs->check = 0;
+    mvs->pseudo = 1;
+    mvs->who = who;
+    mvs->my_attacks = 0;
+    mvs->opponent_attacks = 0;
+    mvs->undefended_squares = 0;
+    mvs->pinned = pinned_pieces(board, who, kingsquare, friendly_occupancy, enemy_occupancy);
+
+    bmloop(board->pieces[who][KNIGHT], square, temp) {
+        attack = attack_set_knight(square, friendly_occupancy, enemy_occupancy);
+        deltaset_add_move(board, who, mvs, KNIGHT, square, attack, friendly_occupancy, enemy_occupancy, 5);
+    }
+    bmloop(board->pieces[who][BISHOP], square, temp) {
+        attack = attack_set_bishop(square, friendly_occupancy, enemy_occupancy);
+        deltaset_add_move(board, who, mvs, BISHOP, square, attack, friendly_occupancy, enemy_occupancy, 5);
+    }
+    bmloop(board->pieces[who][PAWN], square, temp) {
+        attack = attack_set_pawn[who](square, board->enpassant, friendly_occupancy, enemy_occupancy);
+        deltaset_add_move(board, who, mvs, PAWN, square, attack, friendly_occupancy, enemy_occupancy, 5);
+    }
+    bmloop(board->pieces[who][QUEEN], square, temp) {
+        attack = attack_set_queen(square, friendly_occupancy, enemy_occupancy);
+        deltaset_add_move(board, who, mvs, QUEEN, square, attack, friendly_occupancy, enemy_occupancy, 5);
+    }
+    bmloop(board->pieces[who][ROOK], square, temp) {
+        attack = attack_set_rook(square, friendly_occupancy, enemy_occupancy);
+        deltaset_add_move(board, who, mvs, ROOK, square, attack, friendly_occupancy, enemy_occupancy, 5);
+    }
+    attack = attack_set_king(kingsquare, friendly_occupancy, enemy_occupancy);
+    deltaset_add_move(board, who, mvs, KING, kingsquare, attack, friendly_occupancy, enemy_occupancy, 5);
+
+    if (board->cancastle & (who ? (CASTLE_PRIV_BQ | CASTLE_PRIV_BK) : (CASTLE_PRIV_WQ | CASTLE_PRIV_WK))) {
+        uint64_t king = board->pieces[who][KING];
+        uint64_t opponent_attacks = attacked_squares(board, 1-who, enemy_occupancy | (friendly_occupancy ^ king));
+        deltaset_add_castles(mvs, board, who, kingsquare, friendly_occupancy | enemy_occupancy, opponent_attacks);
+    }
+}
+
+/* Pseudo-legal version of generate_qsearch_moves: captures and promotions (see generate_captures)
+ * and castling moves, which have to be checked with is_legal.
+ * In check, the legal evasions are generated instead and mvs->pseudo is cleared.
+ */
+void generate_pseudo_qsearch_moves(struct deltaset* mvs, struct board* board) {
+    uint64_t temp, square;
+    uint64_t attack;
+    side_t who = board->who;
+    uint64_t friendly_occupancy = board_occupancy(board, who);
+    uint64_t enemy_occupancy = board_occupancy(board, 1 - who);
+    int kingsquare = board->kingsq[who];
+
+    if (is_in_check(board, who, friendly_occupancy, enemy_occupancy)) {
+        generate_moves(mvs, board);
+        return;
+    }
+
+    mvs->nmoves = 0;
+    mvs->check = 0;
+    mvs->pseudo = 1;
+    mvs->who = who;
+    mvs->my_attacks = 0;
+    mvs->opponent_attacks = 0;
+    mvs->undefended_squares = 0;
+    mvs->pinned = pinned_pieces(board, who, kingsquare, friendly_occupancy, enemy_occupancy);
+
+    uint64_t mask = enemy_occupancy;
+    uint64_t pawn_mask = mask | RANK1 | RANK8;
+
+    bmloop(board->pieces[who][PAWN], square, temp) {
+        attack = attack_set_pawn_capture[who](square, board->enpassant, friendly_occupancy, enemy_occupancy) & pawn_mask;
+        deltaset_add_move(board, who, mvs, PAWN, square, attack, friendly_occupancy, enemy_occupancy, 2);
+    }
+    bmloop(board->pieces[who][KNIGHT], square, temp) {
+        attack = attack_set_knight(square, friendly_occupancy, enemy_occupancy) & mask;
+        deltaset_add_move(board, who, mvs, KNIGHT, square, attack, friendly_occupancy, enemy_occupancy, 2);
+    }
+    bmloop(board->pieces[who][BISHOP], square, temp) {
+        attack = attack_set_bishop(square, friendly_occupancy, enemy_occupancy) & mask;
+        deltaset_add_move(board, who, mvs, BISHOP, square, attack, friendly_occupancy, enemy_occupancy, 2);
+    }
+    bmloop(board->pieces[who][ROOK], square, temp) {
+        attack = attack_set_rook(square, friendly_occupancy, enemy_occupancy) & mask;
+        deltaset_add_move(board, who, mvs, ROOK, square, attack, friendly_occupancy, enemy_occupancy, 2);
+    }
+    bmloop(board->pieces[who][QUEEN], square, temp) {
+        attack = attack_set_queen(square, friendly_occupancy, enemy_occupancy) & mask;
+        deltaset_add_move(board, who, mvs, QUEEN, square, attack, friendly_occupancy, enemy_occupancy, 2);
+    }
+    attack = attack_set_king(kingsquare, friendly_occupancy, enemy_occupancy) & mask;
+    deltaset_add_move(board, who, mvs, KING, kingsquare, attack, friendly_occupancy, enemy_occupancy, 2);
+
+    if (board->cancastle & (who ? (CASTLE_PRIV_BQ | CASTLE_PRIV_BK) : (CASTLE_PRIV_WQ | CASTLE_PRIV_WK))) {
+        uint64_t king = board->pieces[who][KING];
+        uint64_t opponent_attacks = attacked_squares(board, 1-who, enemy_occupancy | (friendly_occupancy ^ king));
+        deltaset_add_castles(mvs, board, who, kingsquare, friendly_occupancy | enemy_occupancy, opponent_attacks);
+    }
+}
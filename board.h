@@ -45,11 +45,8 @@ extern uint64_t square_hash_codes[64][12];
 extern uint64_t castling_hash_codes[4];
 extern uint64_t enpassant_hash_codes[8];
 extern uint64_t side_hash_code;
-extern struct ttable_entry* ttable;
-
 
 extern int hashmapsize;
-extern int draw_value;
 
 typedef int16_t piece_t;
 
@@ -66,6 +63,13 @@ typedef int16_t piece_t;
  *  6. hash: the Zobrist 64-bit hash of the board
  *  7. castled: indicator for if either side has castled
  *  8. who: the side to move
+ *  9. material_pst: the material and piece-square score of all the pieces, from white's
+ *    point of view, with the midgame and endgame scores packed together (see MAKE_SCORE)
+ *  10. game_phase: the number of pieces on the board, not counting the pawns
+ * The last two are kept up to date by apply_move and reverse_move, so the evaluation
+ * does not have to loop over the pieces to compute them.
+ *  11. mailbox: the piece (WHITEPAWN, ..., BLACKKING) on every square, or -1 if the square is empty.
+ *    It mirrors the bitmaps, to find the piece on a given square without testing all of them.
  */ 
 struct board {
     uint64_t pieces[2][6];
@@ -78,11 +82,22 @@ struct board {
     char castled;
     side_t who;
     uint8_t kingsq[2];
-    int material_score_mg;
-    int pst_score_mg;
+    int material_pst;
     int game_phase;
+    char mailbox[64];
 };
 
+/* A midgame and an endgame score packed into one int, so that a single addition updates both.
+ * The endgame score is held in the lower 16 bits, and the midgame score in the upper 16 bits
+ * (borrowing one from them if the endgame score is negative).
+ */
+#define MAKE_SCORE(mg, eg) ((int) ((unsigned int) (mg) << 16) + (eg))
+#define SCORE_MG(s) ((int16_t) (((unsigned int) (s) + 0x8000) >> 16))
+#define SCORE_EG(s) ((int16_t) (unsigned int) (s))
+
+// Packed score of every piece (WHITEPAWN, ..., BLACKKING) on every square
+extern int material_pst_table[12][64];
+
 /* Data structure for move.
  * Stores all the metadata necessary for a quick reversible change of the board:
  *  1. square1: the original square of the piece
@@ -149,66 +164,6 @@ typedef struct delta move_t;
 #define move_copy(m1, m2) (*((struct delta_compressed *) (m1)) = *((struct delta_compressed *) (m2)))
 
 
-/* An entry in the transposition table This data structure is of size 16 bytes,
- * so that exactly 4 transpositions fit in a single cache slot. When
- * allocating the transposition table, we use posix_memalign to get a 64 byte
- * aligned pointer, so that all entries of the transposition fit in a single
- * cache line.
- *
- * The first 6 bytes of the transposition table is reserved for the stored move.
- * We store a 16-bit signed integer for the score, a 32-bit hash
- * (equal to the upper 32-bits of the 64-bit Zobrist hash),
- * type (ALPHA_CUTOFF, BETA_CUTOFF, EXACT, MOVESTORED),
- * depth of the search, and age (the number of half-moves that
- * have passed in the game at the time of search).
- * If the hash table has size 2^(2n) for some n,
- * then we use the lower 2n bits of the Zobrist hash to index into the
- * transposition table, and the upper 32 bits to guard against collisions.
- * Then, the probability that both the lower 2n bits and upper 32 bits
- * coincide is small if the number of entries in the hash table,
- * 2^(2n), is less than 2^(n + 16).
- * This is true if n < 16, or 2n < 32.
- * Since we support hash tables of size at most 8 GB,
- * 2n is always at most 29, so the probability of collision is small.
- */
-union transposition {
-    move_t move; // Currently 64 bits, can reduce to 32
-    struct {
-        unsigned char square1;
-        unsigned char square2;
-        char piece;
-        char captured;
-        char promotion;
-        char misc;
-        int16_t score;
-        // 8 byte alignment
-        uint32_t hash; // 12 bits??
-        char type; // Needs 4 bits
-        uint8_t depth; // Needs 8 bits
-        int16_t age; // Needs 9 bits
-    } metadata;
-}; // Currently 128 bits
-/* TODO: investigate reducing to 64 bits
-union transposition {
-    move_t move; // Currently 64 bits, can reduce to 32
-    struct {
-        unsigned char square1 : 6;
-        unsigned char enpassant: 2;
-        unsigned char square2 : 6;
-        unsigned char promotion: 2;
-        int16_t score;
-        int16_t hash: 12;
-        char type: 3;
-        char age ;
-        char depth ;
-}; // Currently 128 bits
- */
-
-struct ttable_entry {
-    union transposition slot1;
-    union transposition slot2;
-};
-
 // Output of generate_moves
 // It holds a set of legal moves, along with other useful properties
 // computed along the way
@@ -216,6 +171,7 @@ struct deltaset {
     move_t moves[228]; // 256
     short nmoves;
     char check;
+    char pseudo; // Set if the moves are pseudo-legal, and have to be checked with is_legal
     side_t who;
     uint64_t pinned; // a bitmap of all pinned pieces
     uint64_t opponent_attacks;
@@ -236,13 +192,27 @@ void calgebraic_to_move(struct board* board, char* input, move_t* move);
 void move_to_calgebraic(struct board* board, char* buffer, move_t* move);
 
 /* Scoring */
-int board_score(struct board* board, side_t who, struct deltaset* mvs, int alpha, int beta);
+struct evaluation_cache;
+// The evaluation and the pawn structure are cached in cache, unless it is NULL
+int board_score(struct board* board, side_t who, struct deltaset* mvs, int alpha, int beta,
+        struct evaluation_cache* cache);
+void prefetch_evaluation_cache(struct evaluation_cache* cache, struct board* board);
+void clear_evaluation_cache(struct evaluation_cache* cache);
+void initialize_material_pst_table();
+// Computes material_pst and game_phase from scratch
+void board_init_material_pst(struct board* board);
+// Aborts if material_pst or game_phase differ from a full recompute (used by the DEBUG build)
+void board_check_material_pst(struct board* board);
 
 /* Moving */
 int apply_move(struct board* board, move_t* move);
 int reverse_move(struct board* board, move_t* move);
 void generate_moves(struct deltaset* mvs, struct board* board);
 void generate_captures(struct deltaset* mvs, struct board* board);
+void generate_qsearch_moves(struct deltaset* mvs, struct board* board);
+void generate_pseudo_moves(struct deltaset* mvs, struct board* board);
+void generate_pseudo_qsearch_moves(struct deltaset* mvs, struct board* board);
+int is_legal(struct board* board, move_t* move);
 int is_valid_move(struct board* board, side_t who, struct delta move);
 int is_pseudo_valid_move(struct board* board, side_t who, struct delta move);
 uint64_t board_flip_side(struct board* board, uint64_t enpassant);
@@ -261,9 +231,20 @@ char get_piece_on_square(struct board* board, int square);
 uint64_t attacked_squares(struct board* board, side_t who, uint64_t occ);
 int gives_check(struct board * board, uint64_t occupancy, move_t* move, side_t who);
 
-/* Repeated position detection */
-int position_count_table_read(uint64_t hash);
-void position_count_table_update(uint64_t hash);
+/* Repeated position detection.
+ * Every engine keeps a table of POSITION_COUNT_TABLE_SIZE slots (a power of 2)
+ * counting how many times each position of its game has occured.
+ */
+#define POSITION_COUNT_TABLE_SIZE 1024
+
+struct position_count {
+    uint64_t hash;
+    char valid;
+    char count;
+};
+
+int position_count_table_read(struct position_count* table, uint64_t hash);
+void position_count_table_update(struct position_count* table, uint64_t hash);
 
 /* Opening tables */
 int opening_table_read(uint64_t hash, move_t* move);
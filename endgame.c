@@ -168,7 +168,7 @@ void initialize_endgame_tables() {
 }
 
 // Endgame behaves very differently, so we have a separate scoring function
-int board_score_endgame(struct board* board, unsigned char who, struct deltaset* mvs) {
+int board_score_endgame(struct board* board, unsigned char who, struct deltaset* mvs, struct evaluation_cache* cache) {
     int score = 0;
 
 #define EG_NONE 0
@@ -265,7 +265,8 @@ int board_score_endgame(struct board* board, unsigned char who, struct deltaset*
         score -= sign * popcnt(accessible_squares) * 5;
     }
 
-    struct pawn_structure* pstruct = evaluate_pawns(board);
+    struct pawn_structure uncached;
+    struct pawn_structure* pstruct = evaluate_pawns(board, cache, &uncached);
     int material_score = board_score_eg_material_pst(board, who, mvs, pstruct);
     DPRINTF("Material pieceboard score: %d \n", material_score);
     // For drawish positions, don't over emphasize position
@@ -290,13 +291,7 @@ int board_score_endgame(struct board* board, unsigned char who, struct deltaset*
 
 // Endgame behaves very differently, so we have a separate scoring function
 int board_score_eg_material_pst(struct board* board, unsigned char who, struct deltaset* mvs, struct pawn_structure* pstruct) {
-    uint64_t temp;
     int score = 0;
-    int square, count;
-
-    int wkingsquare, bkingsquare;
-    wkingsquare = board->kingsq[0];
-    bkingsquare = board->kingsq[1];
 
     // Draws from insufficient material
 
@@ -311,43 +306,15 @@ int board_score_eg_material_pst(struct board* board, unsigned char who, struct d
     DPRINTF("Material factor: %.2f\n", factor);
     score += pstruct->score_eg;
     DPRINTF("Pawn score: %d\n", pstruct->score_eg);
-    DPRINTF("total score: %d\n", score);
-
-    bmloop(P2BM(board, WHITEKNIGHT), square, temp) {
-        score += knight_table[63 - square];
-    }
-    bmloop(P2BM(board, BLACKKNIGHT), square, temp) {
-        score -= knight_table[square];
-    }
+    score += SCORE_EG(board->material_pst);
+    DPRINTF("Pst score: %d\n", SCORE_EG(board->material_pst));
 
-    DPRINTF("total score before bishop: %d\n", score);
-    count = 0;
-    bmloop(P2BM(board, WHITEBISHOP), square, temp) {
-        score += bishop_table[63 - square];
-        count += 1;
-    }
     // Bishop pairs are very valuable
     // In the endgame, 2 bishops can checkmate a king,
     // whereas 2 knights can't
-    score += (count == 2) * 60;
-    DPRINTF("total score after bishop: %d\n", score);
-
-    count = 0;
-    bmloop(P2BM(board, BLACKBISHOP), square, temp) {
-        score -= bishop_table[square];
-        count += 1;
-    }
-    score -= (count == 2) * 60;
-    DPRINTF("total score after all bishop: %d\n", score);
-    bmloop(P2BM(board, WHITEROOK), square, temp) {
-        score += rook_table[63 - square];
-    }
-    bmloop(P2BM(board, BLACKROOK), square, temp) {
-        score -= rook_table[square];
-    }
-
-    score += king_table_endgame[63 - wkingsquare];
-    score -= king_table_endgame[bkingsquare];
+    score += (popcnt(P2BM(board, WHITEBISHOP)) == 2) * 60;
+    score -= (popcnt(P2BM(board, BLACKBISHOP)) == 2) * 60;
+    DPRINTF("total score: %d\n", score);
 
     return score;
 }
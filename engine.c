@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,40 +16,50 @@
 
 const wchar_t pretty_piece_names[] = L"\x265f\x265c\x265e\x265d\x265b\x265a\x2659\x2656\x2658\x2657\x2655\x2654";
 
-struct ttable_entry* ttable;
-uint64_t ttable_size = 0;
-
-int hashmapsize = 16777216;
+// Size in megabytes of the transposition table of newly created engines
+int hashmapsize = 512;
 
 void initialize_endgame_tables();
 void load_evaluation_params();
 void read_table(int* table, int max, const cJSON* source);
 
-struct {
+struct engine {
     struct board board;
     move_t moves[1024]; // Move history
     char won;
     int flags;
-} state;
-
-struct position_count {
-    uint64_t hash;
-    char valid;
-    char count;
+    // The value of a draw.
+    // Normally, it is 0, but against weaker opponents,
+    // we can set it to negative, so that even if we are behind,
+    // we try to win instead of draw
+    // Currently, it does nothing.
+    int draw_value;
+
+    // Position count table: counts the number of time a position has occured in the past
+    // Used for draw detection
+    struct position_count position_count_table[POSITION_COUNT_TABLE_SIZE];
+
+    // Transposition table, stop flags and thread count used by the search
+    struct search_shared search;
+
+    // Expected reply to the move found by the last search, in the notation of the move, "" if unknown
+    char ponder_move[8];
 };
 
-// Position count table: counts the number of time a position has occured in the past
-// Used for draw detection
-struct position_count position_count_table[1024];
+// The engine used by the functions that do not take an engine handle
+static engine_t* default_engine = NULL;
 
 uint64_t square_hash_codes[64][12];
 uint64_t castling_hash_codes[4];
 uint64_t enpassant_hash_codes[8];
 uint64_t side_hash_code;
 
+// Seed of the Zobrist hash codes. Saved transposition tables are only valid with the same codes.
+#define ZOBRIST_SEED 0
+
 static void initialize_hash_codes(void) {
     int i, j;
-    rand64_seed(0);
+    rand64_seed(ZOBRIST_SEED);
     // Initialize hash-codes
     for (i = 0; i < 64; i++) {
         for (j = 0; j < 12; j++) {
@@ -64,38 +76,86 @@ static void initialize_hash_codes(void) {
     side_hash_code = rand64();
 }
 
-void position_count_table_update(uint64_t hash) {
-    int hash1 = hash & 0x3ff;
-    if (position_count_table[hash1].valid && position_count_table[hash1].hash == hash) {
-        position_count_table[hash1].count++;
+// Identifies the Zobrist hash codes, in case the way they are generated changes
+static uint64_t zobrist_fingerprint(void) {
+    uint64_t fingerprint = side_hash_code;
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < 12; j++) {
+            fingerprint = ((fingerprint << 1) | (fingerprint >> 63)) ^ square_hash_codes[i][j];
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        fingerprint = ((fingerprint << 1) | (fingerprint >> 63)) ^ castling_hash_codes[i];
+    }
+    for (int i = 0; i < 8; i++) {
+        fingerprint = ((fingerprint << 1) | (fingerprint >> 63)) ^ enpassant_hash_codes[i];
+    }
+    return fingerprint;
+}
+
+void position_count_table_update(struct position_count* table, uint64_t hash) {
+    int hash1 = hash & (POSITION_COUNT_TABLE_SIZE - 1);
+    if (table[hash1].valid && table[hash1].hash == hash) {
+        table[hash1].count++;
     } else {
-        position_count_table[hash1].valid = 1;
-        position_count_table[hash1].hash = hash;
-        position_count_table[hash1].count = 1;
+        table[hash1].valid = 1;
+        table[hash1].hash = hash;
+        table[hash1].count = 1;
     }
 }
 
-int position_count_table_read(uint64_t hash) {
-    int hash1 = hash & 0x3ff;
-    if (position_count_table[hash1].valid && position_count_table[hash1].hash == hash)
-        return position_count_table[hash1].count;
+int position_count_table_read(struct position_count* table, uint64_t hash) {
+    int hash1 = hash & (POSITION_COUNT_TABLE_SIZE - 1);
+    if (table[hash1].valid && table[hash1].hash == hash)
+        return table[hash1].count;
     return 0;
 }
 
-// The value of a draw.
-// Normally, it is 0, but against weaker opponents,
-// we can set it to negative, so that even if we are behind,
-// we try to win instead of draw
-// Currently, it does nothing.
-int draw_value = 0;
-int engine_set_param(int name, int value) {
+int engine_set_param_r(engine_t* engine, int name, int value) {
     if (name == ACE_PARAM_CONTEMPT) {
-        draw_value = value;
+        engine->draw_value = value;
+        return 0;
+    } else if (name == ACE_PARAM_THREADS) {
+        if (value < 1 || value > MAX_SEARCH_THREADS)
+            return 1;
+        engine->search.nthreads = value;
+        return 0;
+    } else if (name == ACE_PARAM_MAX_DEPTH) {
+        if (value < 0)
+            return 1;
+        engine->search.max_depth = value;
+        return 0;
+    } else if (name == ACE_PARAM_MULTIPV) {
+        if (value < 1 || value > MAX_MULTIPV)
+            return 1;
+        engine->search.multipv = value;
+        return 0;
+    } else if (name == ACE_PARAM_MAX_NODES) {
+        if (value < 0)
+            return 1;
+        engine->search.max_nodes = value;
         return 0;
+    } else if (name == ACE_PARAM_HUGE_PAGES || name == ACE_PARAM_NUMA_INTERLEAVE) {
+        // Reallocates the table with the new flags
+        struct ttable* ttable = &engine->search.ttable;
+        int flag = name == ACE_PARAM_HUGE_PAGES ? TTABLE_HUGE_PAGES : TTABLE_NUMA_INTERLEAVE;
+        int flags = value ? (ttable->flags | flag) : (ttable->flags & ~flag);
+        if (flags == ttable->flags)
+            return 0;
+        // A table that is not allocated yet gets the flags when it is
+        if (!ttable->memory) {
+            ttable->flags = flags;
+            return 0;
+        }
+        return ttable_init(ttable, ttable->size, flags, engine->search.nthreads);
     }
     return 1;
 }
 
+int engine_set_param(int name, int value) {
+    return engine_set_param_r(default_engine, name, value);
+}
+
 void engine_init(int flags) {
     static int initialized = 0;
     if (!initialized) {
@@ -103,13 +163,32 @@ void engine_init(int flags) {
         initialize_move_tables();
         initialize_hash_codes();
         initialize_endgame_tables();
-        if (posix_memalign((void **) &ttable, 64, hashmapsize * sizeof(struct ttable_entry))) {
+        load_evaluation_params();
+        default_engine = engine_create(flags);
+        if (!default_engine) {
             exit(1);
         }
-        memset(ttable, 0, hashmapsize * sizeof(struct ttable_entry));
-        load_evaluation_params();
     }
-    state.flags = flags;
+    default_engine->flags = flags;
+}
+
+engine_t* engine_create(int flags) {
+    engine_t* engine = calloc(1, sizeof(engine_t));
+    if (!engine) return NULL;
+    engine->flags = flags;
+    engine->search.nthreads = 1;
+    // The transposition table is allocated by engine_reset_hashmap_r, or with hashmapsize megabytes
+    // by the first search, so that a front end setting its own size does not allocate twice
+    engine->search.ttable.flags = TTABLE_HUGE_PAGES;
+    engine->search.position_counts = engine->position_count_table;
+    engine_new_game_r(engine);
+    return engine;
+}
+
+void engine_destroy(engine_t* engine) {
+    ttable_free(&engine->search.ttable);
+    search_free(&engine->search);
+    free(engine);
 }
 
 void load_evaluation_params() {
@@ -181,6 +260,39 @@ void load_evaluation_params() {
             CAN_CASTLE_BONUS = head->valueint;
         } else if (strcmp(head->string, "TEMPO_BONUS") == 0) {
             TEMPO_BONUS = head->valueint;
+        } else if (strcmp(head->string, "LMR_BASE") == 0) {
+            LMR_BASE = head->valueint;
+        } else if (strcmp(head->string, "LMR_DIVISOR") == 0) {
+            // Both divisors keep their default when not positive
+            if (head->valueint > 0)
+                LMR_DIVISOR = head->valueint;
+            else
+                fprintf(stderr, "Invalid parameter: %s must be positive\n", head->string);
+        } else if (strcmp(head->string, "LMR_PV") == 0) {
+            LMR_PV = head->valueint;
+        } else if (strcmp(head->string, "LMR_HISTORY") == 0) {
+            if (head->valueint > 0)
+                LMR_HISTORY = head->valueint;
+            else
+                fprintf(stderr, "Invalid parameter: %s must be positive\n", head->string);
+        } else if (strcmp(head->string, "LMR_NOT_IMPROVING") == 0) {
+            LMR_NOT_IMPROVING = head->valueint;
+        } else if (strcmp(head->string, "LMR_TT_CAPTURE") == 0) {
+            LMR_TT_CAPTURE = head->valueint;
+        } else if (strcmp(head->string, "RFP_DEPTH") == 0) {
+            RFP_DEPTH = head->valueint;
+        } else if (strcmp(head->string, "RFP_MARGIN") == 0) {
+            RFP_MARGIN = head->valueint;
+        } else if (strcmp(head->string, "RAZOR_DEPTH") == 0) {
+            RAZOR_DEPTH = head->valueint;
+        } else if (strcmp(head->string, "RAZOR_MARGIN") == 0) {
+            RAZOR_MARGIN = head->valueint;
+        } else if (strcmp(head->string, "LMP_DEPTH") == 0) {
+            LMP_DEPTH = head->valueint;
+        } else if (strcmp(head->string, "LMP_BASE") == 0) {
+            LMP_BASE = head->valueint;
+        } else if (strcmp(head->string, "LMP_SCALE") == 0) {
+            LMP_SCALE = head->valueint;
         } else if (strcmp(head->string, "doubled_pawn_penalty") == 0) {
             read_table(doubled_pawn_penalty, 8, head->child);
         } else if (strcmp(head->string, "passed_pawn_table") == 0) {
@@ -235,6 +347,8 @@ void load_evaluation_params() {
     }
     cJSON_Delete(params);
     free(params_contents);
+    initialize_material_pst_table();
+    initialize_reductions();
 }
 
 void read_table(int* table, int max, const cJSON* source) {
@@ -246,208 +360,518 @@ void read_table(int* table, int max, const cJSON* source) {
     }
 }
 
+int engine_reset_hashmap_r(engine_t* engine, int hashsize) {
+    struct ttable* ttable = &engine->search.ttable;
+    uint64_t buckets = (uint64_t) hashsize * 1024 * 1024 / sizeof(struct ttable_bucket);
+    if (hashsize < 1 || buckets > INT_MAX)
+        return 1;
+    return ttable_init(ttable, buckets, ttable->flags, engine->search.nthreads);
+}
+
 int engine_reset_hashmap(int hashsize) {
-    hashmapsize = MSB(hashsize);
-    free(ttable);
-    if (posix_memalign((void **) &ttable, 64, hashmapsize * sizeof(struct ttable_entry))) {
+    return engine_reset_hashmap_r(default_engine, hashsize);
+}
+
+int engine_save_hashmap_r(engine_t* engine, const char* path) {
+    if (!engine->search.ttable.memory)
         return 1;
-    }
-    memset(ttable, 0, hashmapsize * sizeof(struct ttable_entry));
-    return 0;
+    return ttable_save(&engine->search.ttable, path, ZOBRIST_SEED, zobrist_fingerprint());
+}
+
+int engine_save_hashmap(const char* path) {
+    return engine_save_hashmap_r(default_engine, path);
+}
+
+int engine_load_hashmap_r(engine_t* engine, const char* path) {
+    return ttable_load(&engine->search.ttable, path, ZOBRIST_SEED, zobrist_fingerprint());
+}
+
+int engine_load_hashmap(const char* path) {
+    return engine_load_hashmap_r(default_engine, path);
+}
+
+void engine_new_game_r(engine_t* engine) {
+    engine_new_game_from_position_r(engine, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
 }
 
 void engine_new_game() {
-    engine_new_game_from_position("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    engine_new_game_r(default_engine);
 }
 
-char* engine_new_game_from_position(char* position) {
+char* engine_new_game_from_position_r(engine_t* engine, char* position) {
     char * pos;
-    memset(position_count_table, 0, sizeof(position_count_table));
-    pos = board_init_from_fen(&state.board, position);
-    state.won = 0;
+    memset(engine->position_count_table, 0, sizeof(engine->position_count_table));
+    pos = board_init_from_fen(&engine->board, position);
+    engine->won = 0;
     srand(time(NULL));
     return pos;
 }
 
+char* engine_new_game_from_position(char* position) {
+    return engine_new_game_from_position_r(default_engine, position);
+}
+
+void engine_clear_state_r(engine_t* engine) {
+    memset(engine->position_count_table, 0, sizeof(engine->position_count_table));
+    ttable_clear(&engine->search.ttable, engine->search.nthreads);
+    search_clear_history(&engine->search);
+    search_clear_evaluation_caches(&engine->search);
+}
+
 void engine_clear_state() {
-    memset(position_count_table, 0, sizeof(position_count_table));
-    memset(ttable, 0, hashmapsize * sizeof(struct ttable_entry));
-    // memset(history, 0, 2 * 64 * 64 * sizeof(int));
+    engine_clear_state_r(default_engine);
 }
 
 void engine_print_moves() {
     char buffer[16];
     struct board clean_board;
     board_init(&clean_board);
-    for (int i = 0; i < state.board.nmoves; i++) {
-        move_to_calgebraic(&clean_board, buffer, &state.moves[i]);
+    for (int i = 0; i < default_engine->board.nmoves; i++) {
+        move_to_calgebraic(&clean_board, buffer, &default_engine->moves[i]);
         if (i % 2 == 0)
             printf("%d. ", i / 2 + 1);
         printf("%s ", buffer);
-        apply_move(&clean_board, &state.moves[i]);
+        apply_move(&clean_board, &default_engine->moves[i]);
     }
 }
 
-int engine_score() {
+int engine_score_r(engine_t* engine) {
     struct deltaset mvs;
-    generate_moves(&mvs, &state.board);
-    return board_score(&state.board, state.board.who, &mvs,
-            -INFINITY, INFINITY);
+    generate_moves(&mvs, &engine->board);
+    return board_score(&engine->board, engine->board.who, &mvs,
+            -INFINITY, INFINITY, NULL);
+}
+
+int engine_score() {
+    return engine_score_r(default_engine);
 }
 
 int engine_qsearch_score() {
+    struct board* board = &default_engine->board;
     struct timer* timer = new_infinite_timer();
-    return qsearch(&state.board, timer, 12 * 8, -10000, 10000, state.board.who);
+    struct search_ctx* ctx = malloc(sizeof(struct search_ctx));
+    search_ctx_init(ctx, &default_engine->search, board, timer, 0);
+    int score = qsearch(ctx, 12 * 8, -10000, 10000, board->who);
+    free(ctx);
+    free(timer);
+    return score;
+}
+
+struct board* engine_get_board_r(engine_t* engine) {
+    return &engine->board;
 }
 
 struct board* engine_get_board() {
-    return &state.board;
+    return engine_get_board_r(default_engine);
+}
+
+unsigned char engine_get_who_r(engine_t* engine) {
+    return engine->board.who;
 }
 
 unsigned char engine_get_who() {
-    return state.board.who;
+    return engine_get_who_r(default_engine);
+}
+
+int engine_won_r(engine_t* engine) {
+    return engine->won;
 }
 
 int engine_won() {
-    return state.won;
+    return engine_won_r(default_engine);
 }
 
-void engine_perft(int initial, int depth, side_t who,
-        uint64_t* count, uint64_t* enpassants, uint64_t* captures,
-        uint64_t* check, uint64_t* promotions, uint64_t* castles,
-        int eval, int* eval_score) {
+#define MAX_PERFT_THREADS 64
+
+/* An entry of the perft hash table: the node count of a subtree, packed with its depth,
+ * and the hash of its root xored with them. Threads store without locking,
+ * so an entry written half by one thread and half by another is read as a miss.
+ */
+struct perft_entry {
+    uint64_t key; // hash ^ data
+    uint64_t data; // nodes << 8 | depth
+};
+
+struct perft_shared {
+    struct board board; // Root position
+    move_t moves[256]; // Legal root moves
+    uint64_t nodes[256]; // Nodes under every root move
+    int nmoves;
+    int next; // Index of the next root move to count, taken by the threads in turn
+    int depth;
+    int legal; // Generate legal moves instead of pseudo-legal moves
+    int flags; // PERFT_DETAILS, PERFT_EVAL
+    struct perft_entry* table;
+    uint64_t table_size;
+};
+
+struct perft_worker {
+    struct perft_shared* shared;
+    struct board board;
+    struct perft_counts counts;
+};
+
+// Plays a move of the last ply, counting its details
+static void perft_leaf(struct perft_worker* worker, struct board* board, move_t* move) {
+    struct perft_counts* counts = &worker->counts;
+    counts->nodes += 1;
+    if (!(worker->shared->flags & PERFT_DETAILS) || worker->shared->table)
+        return;
+    counts->captures += move->captured != -1;
+    counts->enpassants += (move->misc & 0x40) != 0;
+    counts->castles += (move->misc & 0x80) != 0;
+    counts->promotions += move->promotion != move->piece;
+    apply_move(board, move);
+    counts->checks += is_in_check(board, board->who, board_occupancy(board, board->who),
+            board_occupancy(board, 1 - board->who)) != 0;
+    reverse_move(board, move);
+}
+
+static uint64_t perft_node(struct perft_worker* worker, struct board* board, int depth) {
+    struct perft_shared* shared = worker->shared;
+    struct perft_entry* entry = NULL;
+    if (shared->table && depth > 1) {
+        entry = &shared->table[(uint64_t) (((unsigned __int128) board->hash * shared->table_size) >> 64)];
+        uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+        uint64_t key = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+        if ((key ^ data) == board->hash && (data & 0xff) == (uint64_t) depth) {
+            worker->counts.nodes += data >> 8;
+            return data >> 8;
+        }
+    }
+
     struct deltaset mvs;
+    if (shared->legal)
+        generate_moves(&mvs, board);
+    else
+        generate_pseudo_moves(&mvs, board);
+    if (shared->flags & PERFT_EVAL)
+        worker->counts.eval_score += board_score(board, board->who, &mvs, -30000, 30000, NULL);
+
+    uint64_t start = worker->counts.nodes;
+    if (depth == 1 && !(shared->flags & PERFT_DETAILS)) {
+        // Bulk counting: the moves of the last ply are counted without being played
+        if (!mvs.pseudo) {
+            worker->counts.nodes += mvs.nmoves;
+            return mvs.nmoves;
+        }
+        for (int i = 0; i < mvs.nmoves; i++)
+            worker->counts.nodes += is_legal(board, &mvs.moves[i]);
+        return worker->counts.nodes - start;
+    }
+    for (int i = 0; i < mvs.nmoves; i++) {
+        move_t* move = &mvs.moves[i];
+        if (mvs.pseudo && !is_legal(board, move))
+            continue;
+        if (depth == 1) {
+            perft_leaf(worker, board, move);
+        } else {
+            apply_move(board, move);
+            perft_node(worker, board, depth - 1);
+            reverse_move(board, move);
+        }
+    }
+    uint64_t nodes = worker->counts.nodes - start;
+
+    if (entry) {
+        uint64_t data = (nodes << 8) | depth;
+        __atomic_store_n(&entry->key, board->hash ^ data, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+    }
+    return nodes;
+}
+
+static void* perft_thread(void* arg) {
+    struct perft_worker* worker = (struct perft_worker*) arg;
+    struct perft_shared* shared = worker->shared;
+    worker->board = shared->board;
     int i;
-    generate_moves(&mvs, &state.board);
-    if (eval) {
-        eval_score += board_score(&state.board, who, &mvs, -30000, 30000);
+    while ((i = __sync_fetch_and_add(&shared->next, 1)) < shared->nmoves) {
+        move_t* move = &shared->moves[i];
+        uint64_t start = worker->counts.nodes;
+        if (shared->depth == 1) {
+            perft_leaf(worker, &worker->board, move);
+        } else {
+            apply_move(&worker->board, move);
+            perft_node(worker, &worker->board, shared->depth - 1);
+            reverse_move(&worker->board, move);
+        }
+        shared->nodes[i] = worker->counts.nodes - start;
     }
-    char buffer[8];
-    uint64_t oldhash;
-    if (depth == 0 && mvs.check) *check += 1;
-    for (i = 0; i < mvs.nmoves; i++) {
-        oldhash = state.board.hash;
-        apply_move(&state.board, &mvs.moves[i]);
-        if (mvs.moves[i].captured != -1) {
-            if (depth == 0) *captures += 1;
+    return NULL;
+}
+
+int engine_perft_r(engine_t* engine, int depth, int nthreads, int hash_size, int flags, int divide,
+        struct perft_counts* counts) {
+    struct perft_shared* shared = calloc(1, sizeof(struct perft_shared));
+    if (!shared) return 1;
+    shared->board = engine->board;
+    shared->depth = MAX(depth, 1);
+    shared->legal = (engine->flags & FLAGS_LEGAL_MOVEGEN) != 0;
+    // Cached subtrees are not visited again, so their positions could not be evaluated
+    if (hash_size > 0)
+        flags &= ~PERFT_EVAL;
+    shared->flags = flags;
+    if (hash_size > 0) {
+        shared->table_size = ((uint64_t) hash_size << 20) / sizeof(struct perft_entry);
+        shared->table = calloc(shared->table_size, sizeof(struct perft_entry));
+        if (!shared->table) {
+            free(shared);
+            return 1;
         }
-        if (depth == 0 && (mvs.moves[i].misc & 0x40))
-            *enpassants += 1;
-        if (depth == 0 && (mvs.moves[i].misc & 0x80))
-            *castles += 1;
-        if (depth == 0 && (mvs.moves[i].promotion != mvs.moves[i].piece))
-            *promotions += 1;
-        int oldcount = *count;
-        if (depth == 0) *count += 1;
-        else {
-            engine_perft(depth, depth - 1, 1 - who, count, enpassants, captures, check, promotions, castles, eval, eval_score);
+    }
+
+    struct deltaset mvs;
+    generate_moves(&mvs, &shared->board);
+    shared->nmoves = mvs.nmoves;
+    for (int i = 0; i < mvs.nmoves; i++)
+        shared->moves[i] = mvs.moves[i];
+
+    nthreads = MAX(1, MIN(nthreads, MAX_PERFT_THREADS));
+    struct perft_worker workers[MAX_PERFT_THREADS];
+    pthread_t threads[MAX_PERFT_THREADS];
+    memset(workers, 0, sizeof(workers));
+    for (int t = 0; t < nthreads; t++)
+        workers[t].shared = shared;
+    if (flags & PERFT_EVAL)
+        workers[0].counts.eval_score += board_score(&shared->board, shared->board.who, &mvs, -30000, 30000, NULL);
+
+    // The calling thread counts too, as worker 0
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, perft_thread, &workers[t])) {
+            nthreads = t;
+            break;
         }
-        if (depth == initial) {
-            move_to_algebraic(&state.board, buffer, &mvs.moves[i]);
-            fprintf(stderr, "%s: %llu\n", buffer, *count - oldcount);
+    }
+    perft_thread(&workers[0]);
+    for (int t = 1; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    memset(counts, 0, sizeof(struct perft_counts));
+    for (int t = 0; t < nthreads; t++) {
+        counts->nodes += workers[t].counts.nodes;
+        counts->captures += workers[t].counts.captures;
+        counts->enpassants += workers[t].counts.enpassants;
+        counts->castles += workers[t].counts.castles;
+        counts->promotions += workers[t].counts.promotions;
+        counts->checks += workers[t].counts.checks;
+        counts->eval_score += workers[t].counts.eval_score;
+    }
+
+    if (divide) {
+        char buffer[8];
+        for (int i = 0; i < shared->nmoves; i++) {
+            move_to_algebraic(&shared->board, buffer, &shared->moves[i]);
+            printf("%s %llu\n", buffer, (unsigned long long) shared->nodes[i]);
         }
-        reverse_move(&state.board, &mvs.moves[i]);
-        assert(state.board.hash == oldhash);
     }
+
+    free(shared->table);
+    free(shared);
+    return 0;
 }
 
-static int engine_move_internal(move_t move) {
+int engine_perft(int depth, int nthreads, int hash_size, int flags, int divide, struct perft_counts* counts) {
+    return engine_perft_r(default_engine, depth, nthreads, hash_size, flags, divide, counts);
+}
+
+static int engine_move_internal(engine_t* engine, move_t move) {
     struct deltaset mvs;
 
-    if (state.won) return state.won;
-    if (is_valid_move(&state.board, state.board.who, move))
-        apply_move(&state.board, &move);
+    if (engine->won) return engine->won;
+    if (is_valid_move(&engine->board, engine->board.who, move))
+        apply_move(&engine->board, &move);
     else {
         return -1;
     }
 
-    position_count_table_update(state.board.hash);
+    position_count_table_update(engine->position_count_table, engine->board.hash);
     /*
-    if (position_count_table_read(state.board.hash) >= 4) {
+    if (position_count_table_read(engine->position_count_table, engine->board.hash) >= 4) {
         // Draw
-        state.won = GAME_DRAW;
+        engine->won = GAME_DRAW;
         return 0;
     }
     */
 
-    state.moves[state.board.nmoves - 1] = move;
+    engine->moves[engine->board.nmoves - 1] = move;
 
-    generate_moves(&mvs, &state.board);
+    generate_moves(&mvs, &engine->board);
     int nmoves = mvs.nmoves;
 
     // Checkmate
     if (mvs.check && nmoves == 0) {
-        if (state.board.who) {
-            state.won = GAME_WHITE_WON;
+        if (engine->board.who) {
+            engine->won = GAME_WHITE_WON;
         }
         else {
-            state.won = GAME_BLACK_WON;
+            engine->won = GAME_BLACK_WON;
         }
     }
     // Stalemate
-    else if (nmoves == 0 || state.board.nmovesnocapture >= 100)
-        state.won = GAME_DRAW;
+    else if (nmoves == 0 || engine->board.nmovesnocapture >= 100)
+        engine->won = GAME_DRAW;
     
     return 0;
 }
 
-int engine_search(char * move, int infinite_mode, int wtime, int btime, int winc, int binc, int moves_to_go) {
+static int engine_search_internal(engine_t* engine, char * move, int infinite_mode, int ponder,
+        int wtime, int btime, int winc, int binc, int moves_to_go) {
     struct deltaset mvs;
     struct timer* timer;
 
-    if (state.won) return state.won;
-    generate_moves(&mvs, &state.board);
+    engine->ponder_move[0] = 0;
+    if (engine->won) return engine->won;
+    if (!engine->search.ttable.memory && engine_reset_hashmap_r(engine, hashmapsize)) {
+        fprintf(stderr, "Could not allocate the transposition table\n");
+        exit(1);
+    }
+    generate_moves(&mvs, &engine->board);
     int nmoves = mvs.nmoves;
     if (mvs.check && nmoves == 0) {
-        if (state.board.who)
+        if (engine->board.who)
             return GAME_BLACK_WON;
         else
             return GAME_WHITE_WON;
     }
     // Stalemate
-    else if (nmoves == 0 || state.board.nmovesnocapture >= 100)
-        state.won = GAME_DRAW;
+    else if (nmoves == 0 || engine->board.nmovesnocapture >= 100)
+        engine->won = GAME_DRAW;
 
     if (infinite_mode)
         timer = new_infinite_timer();
     else
-        timer = new_timer(wtime, btime, winc, binc, moves_to_go, state.board.who);
+        timer = new_timer(wtime, btime, winc, binc, moves_to_go, engine->board.who);
+    if (ponder)
+        timer->ponderhit = &engine->search.ponderhit;
+
+    move_t ret = find_best_move(&engine->search, &engine->board, timer, engine->board.who,
+            engine->flags, infinite_mode);
+    // The move must not be played before the opponent does: a search that finished on its own
+    // (at the maximum depth or on a forced mate) waits for the ponderhit or the stop
+    while (ponder && !engine->search.ponderhit && !engine->search.stop) {
+        struct timespec wait = {0, 1000000};
+        nanosleep(&wait, NULL);
+    }
+    // The flags of this search must not stop the next one
+    search_prepare(&engine->search);
 
-    move_t ret = find_best_move(&state.board, timer, state.board.who, state.flags, infinite_mode);
-    if (state.flags & FLAGS_UCI_MODE)
-        move_to_algebraic(engine_get_board(), move, &ret);
+    if (engine->flags & FLAGS_UCI_MODE)
+        move_to_algebraic(&engine->board, move, &ret);
     else
-        move_to_calgebraic(engine_get_board(), move, &ret);
+        move_to_calgebraic(&engine->board, move, &ret);
+
+    move_t* reply = &engine->search.ponder_move;
+    if (reply->piece != -1) {
+        struct board board = engine->board;
+        apply_move(&board, &ret);
+        if (engine->flags & FLAGS_UCI_MODE)
+            move_to_algebraic(&board, engine->ponder_move, reply);
+        else
+            move_to_calgebraic(&board, engine->ponder_move, reply);
+    }
 
     free(timer);
-    return state.won;
+    return engine->won;
+}
+
+int engine_search_r(engine_t* engine, char * move, int infinite_mode,
+        int wtime, int btime, int winc, int binc, int moves_to_go) {
+    return engine_search_internal(engine, move, infinite_mode, 0, wtime, btime, winc, binc, moves_to_go);
+}
+
+int engine_search(char * move, int infinite_mode, int wtime, int btime, int winc, int binc, int moves_to_go) {
+    return engine_search_r(default_engine, move, infinite_mode, wtime, btime, winc, binc, moves_to_go);
+}
+
+int engine_ponder_r(engine_t* engine, char * move, int wtime, int btime, int winc, int binc, int moves_to_go) {
+    return engine_search_internal(engine, move, 0, 1, wtime, btime, winc, binc, moves_to_go);
+}
+
+int engine_ponder(char * move, int wtime, int btime, int winc, int binc, int moves_to_go) {
+    return engine_ponder_r(default_engine, move, wtime, btime, winc, binc, moves_to_go);
+}
+
+void engine_ponderhit_r(engine_t* engine) {
+    search_ponderhit(&engine->search);
+}
+
+void engine_ponderhit() {
+    engine_ponderhit_r(default_engine);
+}
+
+int engine_ponder_move_r(engine_t* engine, char * move) {
+    if (!engine->ponder_move[0])
+        return 1;
+    strcpy(move, engine->ponder_move);
+    return 0;
+}
+
+int engine_ponder_move(char * move) {
+    return engine_ponder_move_r(default_engine, move);
+}
+
+void engine_stop_search_r(engine_t* engine) {
+    search_stop(&engine->search);
+}
+
+void engine_prepare_search_r(engine_t* engine) {
+    search_prepare(&engine->search);
+}
+
+void engine_prepare_search() {
+    engine_prepare_search_r(default_engine);
 }
 
 void engine_stop_search() {
-    search_stop();
+    engine_stop_search_r(default_engine);
 }
 
-int engine_move(char * buffer) {
+uint64_t engine_nodes_r(engine_t* engine) {
+    return engine->search.nodes;
+}
+
+uint64_t engine_nodes() {
+    return engine_nodes_r(default_engine);
+}
+
+void engine_search_info_r(engine_t* engine, struct search_info* info) {
+    info->nodes = engine->search.nodes;
+    info->depth = engine->search.depth;
+    info->tt_hits = engine->search.tt_hits;
+    info->tt_probes = engine->search.tt_probes;
+    info->stop_latency = engine->search.stop_latency;
+}
+
+void engine_search_info(struct search_info* info) {
+    engine_search_info_r(default_engine, info);
+}
+
+int engine_move_r(engine_t* engine, char * buffer) {
     move_t move;
-    if (state.flags & FLAGS_UCI_MODE)
-        algebraic_to_move(engine_get_board(), buffer, &move);
+    if (engine->flags & FLAGS_UCI_MODE)
+        algebraic_to_move(&engine->board, buffer, &move);
     else
-        calgebraic_to_move(engine_get_board(), buffer, &move);
-    int ret = engine_move_internal(move);
+        calgebraic_to_move(&engine->board, buffer, &move);
+    int ret = engine_move_internal(engine, move);
     return ret;
 }
 
-void engine_print() {
-    struct board* board = &state.board;
+int engine_move(char * buffer) {
+    return engine_move_r(default_engine, buffer);
+}
+
+void engine_print_r(engine_t* engine) {
+    struct board* board = &engine->board;
     char fen[256];
     struct deltaset mvs;
-    generate_moves(&mvs, &state.board);
+    generate_moves(&mvs, &engine->board);
 
     board_to_fen(board, fen);
     fprintf(stderr, "FEN: %s\n", fen);
-    int score = board_score(board, state.board.who, &mvs, -INFINITY, INFINITY);
+    int score = board_score(board, engine->board.who, &mvs, -INFINITY, INFINITY, NULL);
     fprintf(stderr, "Static Board Score: %.2f\n", score / 100.0);
-    if (state.board.who == 0) {
+    if (engine->board.who == 0) {
         fprintf(stderr, "White to move!\n");
     } else {
         fprintf(stderr, "Black to move!\n");
@@ -466,3 +890,6 @@ void engine_print() {
     fprintf(stderr, "  a b c d e f g h\n");
 }
 
+void engine_print() {
+    engine_print_r(default_engine);
+}
@@ -19,39 +19,34 @@
 
 #define PINNED
 
-struct evaluation_hash_entry {
-    uint32_t hash;
-    int32_t score;
-};
-
-#define EVALUATION_HASH_SIZE (1024 * 256)
-struct evaluation_hash_entry evaluation_hash[EVALUATION_HASH_SIZE];
-
-int evaluation_cache_calls;
-int evaluation_cache_hits;
-
-int read_evaluation_cache(struct board* board, int* val) {
+int read_evaluation_cache(struct evaluation_cache* cache, struct board* board, int* val) {
     int loc = board->hash & (EVALUATION_HASH_SIZE - 1);
     uint32_t sig = board->hash >> 32;
-    evaluation_cache_calls++;
-    if (evaluation_hash[loc].hash == sig) {
-        *val = evaluation_hash[loc].score;
-        evaluation_cache_hits++;
+    cache->calls++;
+    if (cache->evaluations[loc].hash == sig) {
+        *val = cache->evaluations[loc].score;
+        cache->hits++;
         return 0;
     }
     return 1;
 }
 
-void store_evaluation_cache(struct board* board, int val) {
+void store_evaluation_cache(struct evaluation_cache* cache, struct board* board, int val) {
     int loc = board->hash & (EVALUATION_HASH_SIZE - 1);
     uint32_t sig = board->hash >> 32;
-    evaluation_hash[loc].hash = sig;
-    evaluation_hash[loc].score = val;
+    cache->evaluations[loc].hash = sig;
+    cache->evaluations[loc].score = val;
 }
 
-void clear_evaluation_cache(struct board* board) {
-    memset(evaluation_hash, 0, sizeof(evaluation_hash));
-    memset(pawn_hashmap, 0, sizeof(pawn_hashmap));
+// Starts loading the evaluation cache and pawn hash slots of the position into the cache
+void prefetch_evaluation_cache(struct evaluation_cache* cache, struct board* board) {
+    __builtin_prefetch(&cache->evaluations[board->hash & (EVALUATION_HASH_SIZE - 1)]);
+    __builtin_prefetch(&cache->pawns[board->pawn_hash & (PAWN_HASH_SIZE - 1)]);
+}
+
+void clear_evaluation_cache(struct evaluation_cache* cache) {
+    memset(cache->evaluations, 0, sizeof(cache->evaluations));
+    memset(cache->pawns, 0, sizeof(cache->pawns));
 }
 
 
@@ -78,20 +73,18 @@ int simplified_material_for_player(struct board* board, side_t who) {
         9 * popcnt(board->pieces[who][QUEEN]);
 }
 
-int material_for_player(struct board* board, side_t who) {
+/* The midgame material of the pieces that depends on the other pieces on the board.
+ * The value of the pieces themselves is held in board->material_pst.
+ */
+static int material_adjustment_for_player(struct board* board, side_t who) {
     int npawns = popcnt(board->pieces[who][PAWN]);
     int nknights = popcnt(board->pieces[who][KNIGHT]);
     int nbishops = popcnt(board->pieces[who][BISHOP]);
     int nrooks = popcnt(board->pieces[who][ROOK]);
     int nqueens = popcnt(board->pieces[who][QUEEN]);
-    /* TODO: Optimize this */
     int nopposing = popcnt(board->pieces[1-who][KNIGHT]) + popcnt(board->pieces[1 - who][BISHOP]) + popcnt(board->pieces[1-who][ROOK]);
 
-    int score = MIDGAME_PAWN_VALUE * npawns+
-        MIDGAME_KNIGHT_VALUE * nknights +
-        MIDGAME_BISHOP_VALUE * nbishops +
-        MIDGAME_ROOK_VALUE * nrooks +
-        MIDGAME_QUEEN_VALUE * nqueens;
+    int score = 0;
     score += knight_material_adj_table[npawns] * nknights;
     score += rook_material_adj_table[npawns] * nrooks;
     score += rook_material_adj_table[nopposing] * nqueens;
@@ -100,6 +93,83 @@ int material_for_player(struct board* board, side_t who) {
     return score;
 }
 
+int material_pst_table[12][64];
+
+/* Fills material_pst_table from the evaluation parameters, so it has to be called again
+ * when they change. The midgame score of a piece is its material and its piece-square value,
+ * and the endgame score only its piece-square value: the endgame material is scaled
+ * by the total material left (see board_score_eg_material_pst), so it is not a sum over the pieces.
+ * As in the rest of the evaluation, white pieces look up the mirrored square.
+ */
+void initialize_material_pst_table() {
+    for (int piece = 0; piece < 6; piece++) {
+        int material = 0;
+        int* table_mg = NULL;
+        int* table_eg = NULL;
+        switch (piece) {
+            case PAWN:
+                material = MIDGAME_PAWN_VALUE;
+                break;
+            case KNIGHT:
+                material = MIDGAME_KNIGHT_VALUE;
+                table_mg = table_eg = knight_table;
+                break;
+            case BISHOP:
+                material = MIDGAME_BISHOP_VALUE;
+                table_mg = table_eg = bishop_table;
+                break;
+            case ROOK:
+                material = MIDGAME_ROOK_VALUE;
+                table_mg = table_eg = rook_table;
+                break;
+            case QUEEN:
+                material = MIDGAME_QUEEN_VALUE;
+                table_mg = queen_table;
+                break;
+            case KING:
+                table_mg = king_table;
+                table_eg = king_table_endgame;
+                break;
+        }
+        for (int square = 0; square < 64; square++) {
+            for (int w = 0; w < 2; w++) {
+                int loc = (w == 0) ? 63 - square : square;
+                int mg = material + (table_mg ? table_mg[loc] : 0);
+                int eg = table_eg ? table_eg[loc] : 0;
+                material_pst_table[6 * w + piece][square] = w ? MAKE_SCORE(-mg, -eg) : MAKE_SCORE(mg, eg);
+            }
+        }
+    }
+}
+
+static void compute_material_pst(struct board* board, int* material_pst, int* game_phase) {
+    uint64_t temp;
+    int square;
+    *material_pst = 0;
+    *game_phase = 0;
+    for (int piece = 0; piece < 12; piece++) {
+        bmloop(P2BM(board, piece), square, temp) {
+            *material_pst += material_pst_table[piece][square];
+            *game_phase += piece % 6 != PAWN;
+        }
+    }
+}
+
+void board_init_material_pst(struct board* board) {
+    compute_material_pst(board, &board->material_pst, &board->game_phase);
+}
+
+void board_check_material_pst(struct board* board) {
+    int material_pst, game_phase;
+    compute_material_pst(board, &material_pst, &game_phase);
+    if (material_pst != board->material_pst || game_phase != board->game_phase) {
+        fprintf(stderr, "Incremental material/pst (%d, %d), phase %d differ from recomputed (%d, %d), phase %d\n",
+                SCORE_MG(board->material_pst), SCORE_EG(board->material_pst), board->game_phase,
+                SCORE_MG(material_pst), SCORE_EG(material_pst), game_phase);
+        abort();
+    }
+}
+
 
 /* Scoring the board:
  * We score the board in units of centipawns, taking the following
@@ -130,9 +200,10 @@ int material_for_player(struct board* board, side_t who) {
  *  1. Endgame table
  *  2. Finer material nuances, like material hash table
  */
-int board_score(struct board* board, unsigned char who, struct deltaset* mvs, int alpha, int beta) {
+int board_score(struct board* board, unsigned char who, struct deltaset* mvs, int alpha, int beta,
+        struct evaluation_cache* cache) {
     int score;
-    if (read_evaluation_cache(board, &score) == 0) {
+    if (cache && read_evaluation_cache(cache, board, &score) == 0) {
         return score;
     }
 
@@ -178,13 +249,13 @@ int board_score(struct board* board, unsigned char who, struct deltaset* mvs, in
     }
     */
         
-    int phase = popcnt(board_occupancy(board, 0) ^ P2BM(board, WHITEPAWN)) +
-        popcnt(board_occupancy(board, 1) ^ P2BM(board, BLACKPAWN));
+    int phase = board->game_phase;
 
     if (phase <= 5) {
-        score = board_score_endgame(board, who, mvs);
+        score = board_score_endgame(board, who, mvs, cache);
     } else {
-        struct pawn_structure * pstruct = evaluate_pawns(board);
+        struct pawn_structure uncached;
+        struct pawn_structure * pstruct = evaluate_pawns(board, cache, &uncached);
         int mg_material_pst = board_score_mg_material_pst(board, who, mvs, pstruct);
         if (mg_material_pst * (1-2* who) + 200 < alpha) {
             return mg_material_pst;
@@ -210,7 +281,8 @@ int board_score(struct board* board, unsigned char who, struct deltaset* mvs, in
             score = ((phase - 2) * score_mg  + (10 - phase) * score_eg) / 8 + material_pst_score;
         }
     }
-    store_evaluation_cache(board, score);
+    if (cache)
+        store_evaluation_cache(cache, board, score);
     return score;
 }
 
@@ -685,60 +757,11 @@ static int board_score_mg_positional(struct board* board, unsigned char who, str
 
 static int board_score_mg_material_pst(struct board* board, unsigned char who, struct deltaset* mvs, struct pawn_structure* pstruct) {
     DPRINTF("Scoring board\n");
-    int square;
-    uint64_t temp;
-    int score = 0;
-
-    int whitematerial, blackmaterial;
-    whitematerial = material_for_player(board, 0);
-    blackmaterial = material_for_player(board, 1);
-    score = whitematerial - blackmaterial;
-    /*
-    int captured_material = 7780 - (whitematerial + blackmaterial);
-    captured_material = MAX(captured_material, 0);
-    int balance_score = (score * captured_material) / 8000; // 7780;
-    score += balance_score;
-    */
-
-    DPRINTF("Material score: %d\n", score);
+    int score = SCORE_MG(board->material_pst);
+    DPRINTF("Material and pst score: %d\n", score);
 
+    score += material_adjustment_for_player(board, 0) - material_adjustment_for_player(board, 1);
     score += pstruct->score;
 
-    for (int w = 0; w < 2; w++) {
-        int subscore = 0;
-
-        bmloop(P2BM(board, 6 * w + KNIGHT), square, temp) {
-            int loc = (w == 0) ? 63 - square : square;
-            subscore += knight_table[loc];
-            SQPRINTF("  Sided knight position score for %c%c: %d\n", square, knight_table[loc]);
-        }
-
-        bmloop(P2BM(board, 6 * w + BISHOP), square, temp) {
-            int loc = (w == 0) ? 63 - square : square;
-            subscore += bishop_table[loc];
-            SQPRINTF("  Sided bishop score for %c%c: %d\n", square, bishop_table[loc]);
-        }
-
-        bmloop(P2BM(board, 6 * w + ROOK), square, temp) {
-            int loc = (w == 0) ? 63 - square : square;
-            subscore += rook_table[loc];
-            SQPRINTF("  Sided rook for %c%c: %d\n", square, rook_table[loc]);
-        }
-
-        bmloop(P2BM(board, 6 * w + QUEEN), square, temp) {
-            int loc = (w == 0) ? 63 - square : square;
-            subscore += queen_table[loc];
-            SQPRINTF("  Queen score for %c%c: %d\n", square, queen_table[loc]);
-        }
-
-        square = board->kingsq[w];
-        int loc = (w == 0) ? 63 - square : square;
-        subscore += king_table[loc];
-        SQPRINTF("King score for %c%c: %d\n", square, king_table[loc]);
-
-        if (w) score -= subscore;
-        else score += subscore;
-    }
-
     return score;
 }
@@ -6,7 +6,6 @@
 #include "board.h"
 #include "moves.h"
 #include "pieces.h"
-#include "evaluation_parameters.h"
 
 void board_to_fen(struct board* board, char* fen) {
     int i, j;
@@ -91,6 +90,7 @@ char* board_init_from_fen(struct board* out, char* position) {
 
     for (i = 0; i < 12; i++)
         P2BM(out, i) = 0;
+    memset(out->mailbox, -1, sizeof(out->mailbox));
 
     while (*position) {
         if (rank > 7 || rank < 0 || file > 7 || file < 0) return NULL;
@@ -101,6 +101,7 @@ char* board_init_from_fen(struct board* out, char* position) {
             if (*position == piece_names[i]) {
                 found = 1;
                 P2BM(out, i) |= mask;
+                out->mailbox[square] = i;
             }
         }
         if (!found) {
@@ -124,8 +125,6 @@ char* board_init_from_fen(struct board* out, char* position) {
 
     out->kingsq[0] = LSBINDEX(out->pieces[0][KING]);
     out->kingsq[1] = LSBINDEX(out->pieces[1][KING]);
-    out->material_score_mg = 0;
-    out->pst_score_mg = 0;
 
     for (square = 0; square < 64; square++) {
         char piece = get_piece_on_square(out, square);
@@ -134,48 +133,9 @@ char* board_init_from_fen(struct board* out, char* position) {
             if (piece == WHITEPAWN || piece == BLACKPAWN) {
                 out->pawn_hash ^= square_hash_codes[square][piece];
             }
-            switch (piece) {
-                case WHITEPAWN:
-                    out->material_score_mg += MIDGAME_PAWN_VALUE;
-                    break;
-                case BLACKPAWN:
-                    out->material_score_mg -= MIDGAME_PAWN_VALUE;
-                    break;
-                case WHITEKNIGHT:
-                    out->material_score_mg += MIDGAME_KNIGHT_VALUE;
-                    out->pst_score_mg += knight_table[square];
-                    break;
-                case BLACKKNIGHT:
-                    out->material_score_mg -= MIDGAME_KNIGHT_VALUE;
-                    out->pst_score_mg -= knight_table[square];
-                    break;
-                case WHITEBISHOP:
-                    out->material_score_mg += MIDGAME_BISHOP_VALUE;
-                    out->pst_score_mg += bishop_table[square];
-                    break;
-                case BLACKBISHOP:
-                    out->material_score_mg -= MIDGAME_BISHOP_VALUE;
-                    out->pst_score_mg -= bishop_table[square];
-                    break;
-                case WHITEROOK:
-                    out->material_score_mg += MIDGAME_ROOK_VALUE;
-                    out->pst_score_mg += rook_table[square];
-                    break;
-                case BLACKROOK:
-                    out->material_score_mg -= MIDGAME_ROOK_VALUE;
-                    out->pst_score_mg -= rook_table[square];
-                    break;
-                case WHITEQUEEN:
-                    out->material_score_mg += MIDGAME_QUEEN_VALUE;
-                    out->pst_score_mg += queen_table[square];
-                    break;
-                case BLACKQUEEN:
-                    out->material_score_mg -= MIDGAME_QUEEN_VALUE;
-                    out->pst_score_mg -= queen_table[square];
-                    break;
-            }
         }
     }
+    board_init_material_pst(out);
 
     if (*position == 0) return NULL;
 
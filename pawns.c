@@ -5,17 +5,15 @@
 #include "evaluation_parameters.h"
 #include <stdlib.h>
 
-#define PAWN_HASH_SIZE (1024 * 8)
-struct pawn_structure pawn_hashmap[PAWN_HASH_SIZE];
-
 uint64_t hash(uint64_t wpawns, uint64_t bpawns) {
     return ((wpawns ^ bpawns) * 0x2480041000800801ull) & (PAWN_HASH_SIZE - 1);
 }
 
-struct pawn_structure * evaluate_pawns(struct board* board) {
+struct pawn_structure * evaluate_pawns(struct board* board, struct evaluation_cache* cache,
+        struct pawn_structure* uncached) {
     struct pawn_structure * stored;
-    stored = &pawn_hashmap[board->pawn_hash & 0x1fff];
-    if (stored->pawn_hash == board->pawn_hash) {
+    stored = cache ? &cache->pawns[board->pawn_hash & (PAWN_HASH_SIZE - 1)] : uncached;
+    if (cache && stored->pawn_hash == board->pawn_hash) {
         DPRINTF("Pawn hash collision: %llx\n", board->pawn_hash);
         return stored;
     }
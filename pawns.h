@@ -13,9 +13,29 @@ struct pawn_structure {
     int32_t score_eg;
 };
 
-struct pawn_structure * evaluate_pawns(struct board* board);
-
 #define PAWN_HASH_SIZE (1024 * 8)
-extern struct pawn_structure pawn_hashmap[PAWN_HASH_SIZE];
+#define EVALUATION_HASH_SIZE (1024 * 256)
+
+struct evaluation_hash_entry {
+    uint32_t hash;
+    int32_t score;
+};
+
+/* Caches of the evaluations and of the pawn structures, indexed by hash.
+ * Every search thread has its own (see search_shared), kept from one search to the next,
+ * so that they are read and written without locks.
+ */
+struct evaluation_cache {
+    struct evaluation_hash_entry evaluations[EVALUATION_HASH_SIZE];
+    struct pawn_structure pawns[PAWN_HASH_SIZE];
+    int calls;
+    int hits;
+};
+
+/* Evaluates the pawn structure, or reads it from the cache.
+ * Without a cache (NULL), the structure is computed into uncached.
+ */
+struct pawn_structure * evaluate_pawns(struct board* board, struct evaluation_cache* cache,
+        struct pawn_structure* uncached);
 
 #endif
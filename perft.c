@@ -5,6 +5,7 @@
 #include <getopt.h>
 
 #include "ace.h"
+#include "util.h"
 
 
 
@@ -77,17 +78,40 @@ char* positions[] = {
 static struct option long_options[] = {
     {"starting",  required_argument, 0, 's'},
     {"depth",  required_argument, 0, 'd'},
+    {"legal",  no_argument, 0, 'l'},
+    {"threads",  required_argument, 0, 't'},
+    {"hash",  required_argument, 0, 'H'},
+    {"divide",  no_argument, 0, 'D'},
+    {"details",  no_argument, 0, 'S'},
+    {"eval",  no_argument, 0, 'e'},
     {0, 0, 0, 0}
 };
 
+// Wall clock time in milliseconds; clock() would add up the CPU time of all threads
+static uint64_t wall_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* Usage: perft [--starting FEN] [--depth D] [--legal] [--threads N] [--hash MB] [--divide] [--details] [--eval]
+ * By default, the moves of the last ply are only counted; --details plays them to count the captures,
+ * checks, etc. (slower), and --eval evaluates every position that is not a leaf. Both are ignored with --hash.
+ * The first line printed is "Perft: <nodes> nodes in <seconds> s ...", which test-perft.py reads.
+ * With --divide, it is preceded by a "<move> <nodes>" line for every root move and an empty line.
+ */
 int main(int argc, char* argv[]) {
     int c;
-    int eval = 0;
-    int depth;
+    int perft_flags = 0;
+    int flags = 0;
+    int depth = 1;
+    int threads = 1;
+    int hash_size = 0;
+    int divide = 0;
     char position[256] = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
     while (1) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "s:d:e", long_options, &option_index);
+        c = getopt_long(argc, argv, "s:d:elt:H:DS", long_options, &option_index);
   
         if (c == -1)
             break;
@@ -96,10 +120,25 @@ int main(int argc, char* argv[]) {
                 strcpy(position, optarg);
                 break;
             case 'd':
-                depth = atoi(optarg) - 1;
+                depth = atoi(optarg);
                 break;
             case 'e':
-                eval = 1;
+                perft_flags |= PERFT_EVAL;
+                break;
+            case 'S':
+                perft_flags |= PERFT_DETAILS;
+                break;
+            case 'l':
+                flags |= FLAGS_LEGAL_MOVEGEN;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'H':
+                hash_size = atoi(optarg);
+                break;
+            case 'D':
+                divide = 1;
                 break;
             case '?':
                 break;
@@ -109,26 +148,29 @@ int main(int argc, char* argv[]) {
           }
     }
 
-    engine_init(0);
+    engine_init(flags);
     engine_new_game_from_position(position);
     engine_print();
-    clock_t start = clock();
-    uint64_t count, enpassants, captures, check, promotions, castles;
-    count = 0;
-    enpassants = 0;
-    captures = 0;
-    check = 0;
-    castles = 0;
-    promotions = 0;
-    int eval_score = 0;
-    engine_perft(depth, depth, engine_get_who(), &count, &enpassants, &captures, &check, &promotions, &castles,
-                 eval, &eval_score);
-    clock_t end = clock();
-    printf("Perft: %llu nodes in %.2f s (%.2f moves/sec)\n"
-            "%llu captures, %llu enpassants, %llu checks, %llu promotions, %llu castles\n",
-            count,
-            (end - start) * 1.0/ CLOCKS_PER_SEC,
-            count/(((float) (end - start)) / CLOCKS_PER_SEC),
-            captures, enpassants, check, promotions, castles
-            );
+    struct perft_counts counts;
+    uint64_t start = wall_time_ms();
+    if (engine_perft(depth, threads, hash_size, perft_flags, divide, &counts)) {
+        fprintf(stderr, "Could not allocate the perft hash table\n");
+        return 1;
+    }
+    double elapsed = MAX(wall_time_ms() - start, 1) / 1000.0;
+    if (divide)
+        printf("\n");
+    printf("Perft: %llu nodes in %.2f s (%.2f moves/sec)\n",
+            (unsigned long long) counts.nodes, elapsed, counts.nodes / elapsed);
+    printf("Threads: %d, %.2f Mnps per thread\n", threads, counts.nodes / elapsed / 1e6 / threads);
+    if ((perft_flags & PERFT_DETAILS) && hash_size == 0) {
+        printf("%llu captures, %llu enpassants, %llu checks, %llu promotions, %llu castles\n",
+                (unsigned long long) counts.captures, (unsigned long long) counts.enpassants,
+                (unsigned long long) counts.checks, (unsigned long long) counts.promotions,
+                (unsigned long long) counts.castles);
+    }
+    if ((perft_flags & PERFT_EVAL) && hash_size == 0) {
+        printf("Evaluation sum: %lld\n", (long long) counts.eval_score);
+    }
+    return 0;
 }
@@ -6,6 +6,7 @@ import time
 
 import json
 import argparse
+import tempfile
 
 import chess
 import chess.engine
@@ -93,9 +94,37 @@ parser.add_argument("-w", dest="white")
 parser.add_argument("-b", dest="black")
 parser.add_argument("-n", dest="ngames", default=150, type=int)
 parser.add_argument("--opening", dest="opening", default="")
+# With --tc, the engines play with a clock: a total time per game (plus an increment) instead of 1 second per move.
+# This is what measures the time manager, so the time spent per move is also reported.
+parser.add_argument("--tc", dest="tc", default=0, type=float, help="seconds per game and player")
+parser.add_argument("--inc", dest="inc", default=0, type=float, help="increment per move in seconds")
+# With --white-param and --black-param KEY=VALUE (repeatable), an engine plays with the parameters of params.json,
+# some of them replaced, so that two settings of the search or evaluation parameters (LMR_BASE, RFP_MARGIN, ...)
+# can be compared with the same binary.
+parser.add_argument("--white-param", dest="white_params", action="append", default=[], metavar="KEY=VALUE")
+parser.add_argument("--black-param", dest="black_params", action="append", default=[], metavar="KEY=VALUE")
 
 args = parser.parse_args()
 
+def params_dir(overrides):
+    # The engine reads params.json from its working directory: write the replaced parameters to a new one
+    if not overrides:
+        return None
+    with open("params.json") as f:
+        params = json.load(f)
+    for override in overrides:
+        key, value = override.split("=")
+        params[key] = int(value)
+    directory = tempfile.mkdtemp(prefix="ace-params-")
+    with open(os.path.join(directory, "params.json"), "w") as f:
+        f.write(json.dumps(params, indent=4))
+    return directory
+
+white_dir = params_dir(args.white_params)
+black_dir = params_dir(args.black_params)
+white_name = " ".join([args.white] + args.white_params)
+black_name = " ".join([args.black] + args.black_params)
+
 def to_pgn(board):
     pgn = chess.pgn.Game()
     pgn.headers["Result"] = board.result(claim_draw=True)
@@ -104,6 +133,9 @@ def to_pgn(board):
         node = node.add_variation(move)
     return pgn
 
+# Time spent per move by the engines given as -w and -b
+move_times = {}
+
 def play_game(engines, opening):
     current_player = 0
     moves = []
@@ -111,14 +143,32 @@ def play_game(engines, opening):
     board = chess.Board()
     for move in opening:
         board.push_san(move)
+    # Remaining time of the player with the white and black pieces
+    clocks = [args.tc, args.tc]
     while not board.is_game_over(claim_draw=True):
+        if args.tc:
+            limit = chess.engine.Limit(white_clock=clocks[0], black_clock=clocks[1],
+                                       white_inc=args.inc, black_inc=args.inc)
+        else:
+            limit = chess.engine.Limit(time=1)
+        color = 0 if board.turn == chess.WHITE else 1
         try:
-            result = engines[current_player].play(
-                board, chess.engine.Limit(time=1))
+            start = time.monotonic()
+            result = engines[current_player].play(board, limit)
+            elapsed = time.monotonic() - start
         except Exception as e:
             time.sleep(5)
             print(to_pgn(board))
             raise e
+        move_times.setdefault(engines[current_player].name, []).append(elapsed)
+        if args.tc:
+            clocks[color] -= elapsed
+            if clocks[color] < 0:
+                # Lost on time, unless the opponent cannot mate
+                if board.has_insufficient_material(not board.turn):
+                    return "1/2-1/2", board, moves
+                return ("0-1" if color == 0 else "1-0"), board, moves
+            clocks[color] += args.inc
         board.push(result.move)
         current_player = 1 - current_player
 
@@ -141,9 +191,11 @@ for j in range(0, args.ngames):
         if name != args.opening:
             continue
     engines = [
-        chess.engine.SimpleEngine.popen_uci(args.white),
-        chess.engine.SimpleEngine.popen_uci(args.black),
+        chess.engine.SimpleEngine.popen_uci(os.path.abspath(args.white) if white_dir else args.white, cwd=white_dir),
+        chess.engine.SimpleEngine.popen_uci(os.path.abspath(args.black) if black_dir else args.black, cwd=black_dir),
     ]
+    engines[0].name = white_name
+    engines[1].name = black_name
     try:
         if reversed_players:
             outcome, board, moves = play_game(list(reversed(engines)), opening)
@@ -158,11 +210,11 @@ for j in range(0, args.ngames):
 
     pgn = to_pgn(board)
     if reversed_players:
-        pgn.headers["White"] = args.black
-        pgn.headers["Black"] = args.white
+        pgn.headers["White"] = black_name
+        pgn.headers["Black"] = white_name
     else:
-        pgn.headers["White"] = args.white
-        pgn.headers["Black"] = args.black
+        pgn.headers["White"] = white_name
+        pgn.headers["Black"] = black_name
     print(pgn)
 
     points = [0, 0]
@@ -190,12 +242,17 @@ for j in range(0, args.ngames):
 
     print("=============================================")
     print("Opening: %s. Moves: %s" % (name, opening))
-    print("Engine %s: %s - %s - %s" % (args.white, wins[0], draws[0], losses[0]))
-    print("Engine %s: %s - %s - %s" % (args.black, wins[1], draws[1], losses[1]))
+    print("Engine %s: %s - %s - %s" % (white_name, wins[0], draws[0], losses[0]))
+    print("Engine %s: %s - %s - %s" % (black_name, wins[1], draws[1], losses[1]))
     if wins[0] + draws[0] > 0 and losses[0] + draws[0] > 0:
         elo_diff, confidence = elo.estimate_elo_diff(wins[0], draws[0], losses[0])
         print("Elo diff: %d. 95%% confidence interval: (%.1f, %.1f)" % (elo_diff, confidence[0], confidence[1]))
     for name, scores in score_for_opening.items():
         print("Score for %s: %d - %d - %d" % (name, scores[0], scores[1], scores[2]))
+    for name in (white_name, black_name):
+        times = sorted(move_times.get(name, []))
+        if times:
+            print("Time per move for %s: average %.3f s, median %.3f s, max %.3f s over %d moves" % (
+                name, sum(times) / len(times), times[len(times) // 2], times[-1], len(times)))
     print("=============================================")
 
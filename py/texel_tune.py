@@ -153,7 +153,8 @@ LN10 = np.log(10)
 
 
 def write_params(params, name="params.json"):
-    param_dict = {}
+    # Start from the loaded parameters, so that the ones not tuned here (search parameters such as LMR_*) are kept
+    param_dict = dict(global_params)
     idx = 0
     for key, shape in zip(param_keys, param_shapes):
         if shape == 1:
@@ -1,58 +1,22 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include "pawns.h"
 #include "pieces.h"
 #include "search.h"
 #include "timer.h"
 #include "util.h"
 
-// Transposition table code
-
-#define ALPHA_CUTOFF 1
-#define BETA_CUTOFF 2
-#define EXACT 4
-#define MOVESTORED 8
-
 #define ONE_PLY 8
 
-// Statistics
-
-int tt_hits = 0;
-int tt_tot = 0;
-int alpha_cutoff_count = 0;
-int beta_cutoff_count = 0;
-int short_circuit_count = 0;
-int branches = 0;
-int main_branches = 0;
-
-extern int evaluation_cache_calls;
-extern int evaluation_cache_hits;
-
-// Global state
-
-int ply;
-int out_of_time = 0;
-int ttable_stored_count = 0;
-volatile int signal_stop = 0;
-
 int material_table[6] = {100, 500, 300, 300, 900, 30000};
 
-struct killer_slot {
-    move_t mate_killer;
-    move_t m1;
-    move_t m2;
-};
-
-struct killer_slot killer[32];
-uint64_t seen[64];
-uint32_t history[2][64][64];
-
-static int ttable_search(struct board* restrict board, int who, int depth, move_t* restrict best,
-        move_t* restrict move, int * restrict alpha, int beta);
-static int transform_checkmate(struct board* board, union transposition* trans);
+static int ttable_search(struct search_ctx* ctx, int who, int depth, move_t* restrict best,
+        move_t* restrict move, int * restrict alpha, int beta, move_t* excluded, struct transposition* entry);
 
 static int is_checkmate(int score) {
     return (score > CHECKMATE - 1200) || (score < -CHECKMATE + 1200);
@@ -60,94 +24,48 @@ static int is_checkmate(int score) {
 
 // Transposition table probing and updating
 
-static void ttable_update_with_hash(int loc, union transposition * update, int count) {
-    union transposition* entry = &ttable[loc].slot1;
-    union transposition* secondary_entry = &ttable[loc].slot2;
-    if (entry->metadata.type) {
-        if (entry->metadata.hash == update->metadata.hash) {
-            *entry = *update;
-        } else {
-            if (!secondary_entry->metadata.type) {
-                ttable_stored_count++;
-                *secondary_entry = *update;
-                return;
-            }
-            if (secondary_entry->metadata.hash == update->metadata.hash) {
-                *secondary_entry = *update;
-            } else {
-                if (update->metadata.depth >= entry->metadata.depth) {
-                    *entry = *update;
-                } else {
-                    if (secondary_entry->metadata.depth >= entry->metadata.depth) {
-                        *entry = *secondary_entry;
-                    }
-                    *secondary_entry = *update;
-                }
-            }
-        }
-    } else {
-        if (secondary_entry->metadata.type) {
-            if (secondary_entry->metadata.hash == update->metadata.hash) {
-                *secondary_entry = *update;
-            } else {
-                *entry = *update;
-                ttable_stored_count++;
-            }
-        } else {
-            *entry = *update;
-            ttable_stored_count++;
-        }
-    }
+/* Mating scores are stored relative to the position, since the same position can be reached at
+ * different moves of the game. For example, if we found "mate on move 10" when searching for move 5,
+ * we store "mate in 5 moves", so that when we retrieve the entry when searching for move 7,
+ * we change it to "mate on move 12".
+ */
+static int score_to_ttable(struct board* board, int score) {
+    if (score > CHECKMATE - 1200)
+        return score + board->nmoves;
+    else if (score < -CHECKMATE + 1200)
+        return score - board->nmoves;
+    return score;
 }
 
-static void ttable_update(uint64_t hash, union transposition * update) {
-    int loc = (hashmapsize - 1) & hash;
-    update->metadata.hash = hash >> 32;
-    ttable_update_with_hash(loc, update, 0);
+static int score_from_ttable(struct board* board, int score) {
+    if (score > CHECKMATE - 1200)
+        return score - board->nmoves;
+    else if (score < -CHECKMATE + 1200)
+        return score + board->nmoves;
+    return score;
 }
 
-static int ttable_read(uint64_t hash, union transposition** value) {
-    int loc = (hashmapsize - 1) & hash;
-    uint32_t sig = hash >> 32;
-    tt_tot += 1;
-    if (ttable[loc].slot2.metadata.hash == sig) {
-        *value = &ttable[loc].slot2;
-        tt_hits += 1;
-        return 0;
-    } else if (ttable[loc].slot1.metadata.hash == sig) {
-        *value = &ttable[loc].slot1;
-        tt_hits += 1;
-        return 0;
-    }
-    return -1;
+static void ttable_update(struct search_ctx* ctx, uint64_t hash, struct transposition * update) {
+    ttable_store(&ctx->shared->ttable, hash, update);
 }
 
-// Print principal variation
-static void print_pv(struct board* board, int depth) {
-    union transposition* stored;
-    char buffer[8];
-    move_t move;
-    if (depth == 0) return;
-    if (ttable_read(board->hash, &stored) == 0) {
-        if (stored->metadata.type & MOVESTORED) {
-            move_copy(&move, &stored->move);
-            move_to_algebraic(board, buffer, &move);
-            printf(" %s", buffer);
-            apply_move(board, &move);
-            print_pv(board, depth - 1);
-            reverse_move(board, &move);
-        }
+static int ttable_read(struct search_ctx* ctx, uint64_t hash, struct transposition* value) {
+    ctx->tt_tot += 1;
+    if (ttable_probe(&ctx->shared->ttable, hash, value) == 0) {
+        ctx->tt_hits += 1;
+        return 0;
     }
+    return -1;
 }
 
-// Update killers for given ply
-static void update_killer(int ply, move_t* m, int beta) {
+// Update the killers of a ply
+static void update_killer(struct killer_slot* killer, move_t* m, int beta) {
     // TODO: enforce not equal?
     if (beta > CHECKMATE/2) {
-        move_copy(&killer[ply].mate_killer, m);
-    } else if (!move_equal(*m, killer[ply].m1)) {
-        move_copy(&killer[ply].m2, &killer[ply].m1);
-        move_copy(&killer[ply].m1, m);
+        move_copy(&killer->mate_killer, m);
+    } else if (!move_equal(*m, killer->m1)) {
+        move_copy(&killer->m2, &killer->m1);
+        move_copy(&killer->m1, m);
     }
 }
 
@@ -168,6 +86,9 @@ static void insertion_sort(move_t* moves, int* scores, int start, int end) {
 }
 
 int no_recap_move_see(struct board* board, move_t* move) {
+    // Quiet moves get here from qsearch when in check
+    if (move->captured == -1)
+        return material_table[move->promotion] - material_table[move->piece];
     return material_table[move->captured] + material_table[move->promotion] - material_table[move->piece];
 }
 
@@ -176,7 +97,7 @@ int move_see(struct board* board, move_t* move) {
     uint64_t white_occupancy = board_occupancy(board, 0);
     uint64_t black_occupancy = board_occupancy(board, 1);
     uint64_t from = (1ull) << (move->square1);
-    int who = (white_occupancy & from) ? 0 : 1;
+    int who = board->mailbox[move->square1] >= 6;
     uint64_t occupancy = white_occupancy | black_occupancy;
 
     int gain[32];
@@ -216,244 +137,370 @@ int move_see(struct board* board, move_t* move) {
     return gain[0];
 }
 
+/* Moves are picked in stages, so that the work of ordering a move is only done
+ * when the search gets to it. Most beta cutoffs happen on one of the first moves,
+ * in which case the later stages are never scored:
+ * 1. The move from the transposition table, which needs no scoring at all
+ * 2. Winning captures and queen promotions, ordered by MVV-LVA and capture history
+ * 3. Killer moves (moves that caused beta-cutoffs in sibling nodes), the mate killer first,
+ *    then the counter move (the move that last refuted the previous move)
+ * 4. Even captures, ordered the same way
+ * 5. All other moves, ordered by history heuristic: the history of the move,
+ *    and its continuation history after the moves 1 and 2 plies before. Quiet checks come first,
+ *    quiet moves to squares that the opponent attacks and we do not defend are penalized,
+ *    and losing captures and underpromotions are penalized by their static exchange evaluation
+ *
+ * At the start of a stage, its moves are swapped to the front of the moves not tried yet,
+ * and within a stage, the move with the best score is picked first.
+ */
+enum move_stage {
+    STAGE_TABLEMOVE,
+    STAGE_GOOD_CAPTURES,
+    STAGE_KILLERS,
+    STAGE_EVEN_CAPTURES,
+    STAGE_QUIETS
+};
+
 struct sorted_move_iterator {
     int scores[256];
     move_t* moves;
     move_t* move;
+    struct killer_slot* killers; // Of the ply of the node
+    move_t counter_move; // Piece is -1 if there is none
+    continuation_t* continuation[2]; // After the moves 1 and 2 plies before, NULL if there is none
     uint64_t undefended;
-    int16_t idx;
-    uint8_t depth;
+    char pseudo; // Set for pseudo-legal moves, for which undefended is not computed by the move generation
+    int16_t idx; // Index of the last move returned
     uint8_t end;
-    uint8_t sorted_count;
-    uint8_t finished_tablemove;
+    uint8_t stage;
+    uint8_t stage_end; // The moves of the current stage are the ones between idx and stage_end
 };
 
-#define SORTPHASE0 200000000
-#define SORTPHASE1 180000000
-#define SORTPHASE2 160000000
-#define SORTPHASE3 140000000
-#define SORTPHASE4 120000000
-#define SORTPHASE5 100000000
-#define SORTPHASE6 80000000
-#define SORTPHASE7 60000000
+// History scores are bounded by 3 * HISTORY_MAX, so that quiet checks always come before other quiet moves
 #define PHASEGAP 20000000
 
-/* Sorts the available moves according to how good it is. The criterion is:
- * 1. Moves that result in a won position in the transposition table
- * 2. Moves that give check
- * 3. Captures and pawn promotions. The score of such a move is the value of the captured piece,
- *    minus the value of the capturing piece if the attacked square is defended,
- *    plus the value of the promotion if the pawn cannot be taken immediately
- * 4. Killer moves (moves that caused beta-cutoffs in sibling nodes)
- * 5. All other moves, sorted by history heuristic
- *
- * Ties are broken by the score of the position after the move as recorded in the transposition table
+static inline int is_tactical(move_t* move) {
+    return move->captured != -1 || move->promotion != move->piece;
+}
+
+static inline int is_underpromotion(move_t* move) {
+    return move->promotion != move->piece && move->promotion != QUEEN;
+}
+
+// Continuation history after the move played plies_ago plies before the node at ply, NULL if there is none
+static inline continuation_t* continuation_history(struct search_ctx* ctx, int ply, int plies_ago, int who) {
+    if (ply < plies_ago)
+        return NULL;
+    move_t* prev = &ctx->stack[ply - plies_ago].move;
+    if (prev->piece == -1)
+        return NULL;
+    // The opponent played the move 1 ply before, and we played the one 2 plies before
+    int side = plies_ago == 1 ? 1 - who : who;
+    return &ctx->history->continuation[6 * side + prev->piece][prev->square2];
+}
+
+// Slot of the counter move to the previous move of the node at ply, NULL if there is none
+static inline move_t* counter_move(struct search_ctx* ctx, int ply, int who) {
+    if (ply < 1)
+        return NULL;
+    move_t* prev = &ctx->stack[ply - 1].move;
+    if (prev->piece == -1)
+        return NULL;
+    return &ctx->history->counter_moves[6 * (1 - who) + prev->piece][prev->square2];
+}
+
+static inline int history_score(struct search_ctx* ctx, continuation_t** continuation, move_t* move, int who) {
+    int piece = 6 * who + move->piece;
+    int score = ctx->history->history[who][move->square1][move->square2];
+    for (int i = 0; i < 2; i++) {
+        if (continuation[i])
+            score += (*continuation[i])[piece][move->square2];
+    }
+    return score;
+}
+
+// Bonus of a quiet move that caused a cutoff at depth, and malus of the quiet moves tried before it
+static inline int history_bonus(int depth) {
+    return MIN(32 * (depth / ONE_PLY) * (depth / ONE_PLY), 4096);
+}
+
+/* Gravity: an entry moves by the bonus less a share of its own value,
+ * which keeps it between -HISTORY_MAX and HISTORY_MAX, and lets recent results outweigh old ones.
  */
-static void sorted_move_iterator_score(struct sorted_move_iterator* move_iter, struct board* board, char who, int phase, int start) {
-    for (int i = start; i < move_iter->end; i++) {
-        int see = move_see(board, &move_iter->moves[i]);
-        int non_queen_promotion = move_iter->moves[i].piece != move_iter->moves[i].promotion && move_iter->moves[i].promotion != QUEEN;
-        if (phase == 0) {
-            if (move_equal(move_iter->moves[i], killer[ply].mate_killer)) {
-                move_iter->scores[i] = SORTPHASE1 + 30000;
-                move_iter->sorted_count += 1;
-                continue;
-            }
-            if (see > 0 && !non_queen_promotion) {
-                move_iter->scores[i] = SORTPHASE1 + see;
-                move_iter->sorted_count += 1;
-                continue;
+static inline void history_entry_update(int16_t* entry, int bonus) {
+    *entry += bonus - *entry * abs(bonus) / HISTORY_MAX;
+}
+
+// Least valuable attacker first, by piece (PAWN, ROOK, KNIGHT, BISHOP, QUEEN, KING)
+static const int attacker_rank[6] = {0, 3, 1, 2, 4, 5};
+
+/* MVV-LVA: the most valuable victim (or promotion) first, then the least valuable attacker.
+ * The capture history of the piece, destination and victim breaks the ties between victims of the same value,
+ * and can move a capture ahead of one that takes a victim worth a pawn more.
+ * Qsearch can run without a history table (engine_qsearch_score), hence the check.
+ */
+static inline int capture_score(struct search_ctx* ctx, move_t* move, int who) {
+    int score = 8 * (material_table[move->promotion] - material_table[move->piece]) - attacker_rank[move->piece];
+    if (move->captured != -1) {
+        score += 8 * material_table[move->captured];
+        if (ctx->history)
+            score += ctx->history->capture_history[6 * who + move->piece][move->square2][move->captured] / 16;
+    }
+    return score;
+}
+
+static inline void capture_history_update(struct search_ctx* ctx, move_t* move, int who, int bonus) {
+    history_entry_update(&ctx->history->capture_history[6 * who + move->piece][move->square2][move->captured], bonus);
+}
+
+static void history_update(struct search_ctx* ctx, continuation_t** continuation, move_t* move, int who, int bonus) {
+    int piece = 6 * who + move->piece;
+    history_entry_update(&ctx->history->history[who][move->square1][move->square2], bonus);
+    for (int i = 0; i < 2; i++) {
+        if (continuation[i])
+            history_entry_update(&(*continuation[i])[piece][move->square2], bonus);
+    }
+}
+
+static inline void sorted_move_iterator_swap(struct sorted_move_iterator* move_iter, int i, int j) {
+    move_t tm;
+    move_copy(&tm, &move_iter->moves[i]);
+    move_copy(&move_iter->moves[i], &move_iter->moves[j]);
+    move_copy(&move_iter->moves[j], &tm);
+    int tmp = move_iter->scores[i];
+    move_iter->scores[i] = move_iter->scores[j];
+    move_iter->scores[j] = tmp;
+}
+
+// Gathers and scores the moves of the next stage
+static void sorted_move_iterator_next_stage(struct sorted_move_iterator* move_iter, struct search_ctx* ctx, char who) {
+    struct board* board = &ctx->board;
+    struct killer_slot* killer = move_iter->killers;
+    int n = move_iter->stage_end;
+    move_iter->stage++;
+    switch (move_iter->stage) {
+        case STAGE_GOOD_CAPTURES:
+            // Every capture is scored here once. The ones that do not win material
+            // keep their score for the later stages
+            for (int i = n; i < move_iter->end; i++) {
+                move_t* move = &move_iter->moves[i];
+                if (!is_tactical(move))
+                    continue;
+                int see = move_see(board, move);
+                move_iter->scores[i] = see;
+                if (see > 0 && !is_underpromotion(move)) {
+                    move_iter->scores[i] = capture_score(ctx, move, who);
+                    sorted_move_iterator_swap(move_iter, i, n++);
+                }
             }
-            if (move_equal(move_iter->moves[i], killer[ply].m1)) {
-                move_iter->scores[i] = SORTPHASE2;
-                move_iter->sorted_count += 1;
-                continue;
+            break;
+        case STAGE_KILLERS:
+            for (int i = n; i < move_iter->end; i++) {
+                move_t* move = &move_iter->moves[i];
+                if (move_equal(*move, killer->mate_killer))
+                    move_iter->scores[i] = 4;
+                else if (move_equal(*move, killer->m1))
+                    move_iter->scores[i] = 3;
+                else if (move_equal(*move, killer->m2))
+                    move_iter->scores[i] = 2;
+                else if (move_equal(*move, move_iter->counter_move))
+                    move_iter->scores[i] = 1;
+                else
+                    continue;
+                sorted_move_iterator_swap(move_iter, i, n++);
             }
-            if (move_equal(move_iter->moves[i], killer[ply].m2)) {
-                move_iter->scores[i] = SORTPHASE3;
-                move_iter->sorted_count += 1;
-                continue;
+            break;
+        case STAGE_EVEN_CAPTURES:
+            for (int i = n; i < move_iter->end; i++) {
+                move_t* move = &move_iter->moves[i];
+                if (is_tactical(move) && move_iter->scores[i] == 0 && !is_underpromotion(move)) {
+                    move_iter->scores[i] = capture_score(ctx, move, who);
+                    sorted_move_iterator_swap(move_iter, i, n++);
+                }
             }
-            move_iter->scores[i] = 0;
-            continue;
-        }
-        apply_move(board, &move_iter->moves[i]);
-        uint64_t occupancy = board_occupancy(board, 0) | board_occupancy(board, 1);
-        uint64_t check_move = is_in_check(board, 1 - who, 0, occupancy);
-        reverse_move(board, &move_iter->moves[i]);
-        int history_score = history[who][move_iter->moves[i].square1][move_iter->moves[i].square2];
-        history_score = MIN(history_score, PHASEGAP);
-
-        if (move_iter->moves[i].captured != -1) {
-            if (check_move) {
-                move_iter->scores[i] = SORTPHASE4 + see;
-                move_iter->sorted_count += 1;
-                continue;
+            break;
+        case STAGE_QUIETS: {
+            // All the moves that are left: the captures among them already hold their static exchange evaluation
+            uint64_t occupancy = board_occupancy(board, 0) | board_occupancy(board, 1);
+            if (move_iter->pseudo) {
+                uint64_t occupancy_without_king = occupancy ^ board->pieces[who][KING];
+                move_iter->undefended = attacked_squares(board, 1 - who, occupancy_without_king)
+                    & ~attacked_squares(board, who, occupancy_without_king);
             }
-            if (see == 0) {
-                move_iter->scores[i] = SORTPHASE5 + history_score;
-                move_iter->sorted_count += 1;
-                continue;
+            for (int i = n; i < move_iter->end; i++) {
+                move_t* move = &move_iter->moves[i];
+                int score = history_score(ctx, move_iter->continuation, move, who);
+                if (is_tactical(move)) {
+                    score += move_iter->scores[i];
+                } else {
+                    if (gives_check(board, occupancy, move, who))
+                        score += PHASEGAP;
+                    if (move_iter->undefended & (1ull << move->square2))
+                        score -= material_table[move->piece];
+                }
+                move_iter->scores[i] = score;
             }
+            n = move_iter->end;
+            break;
         }
-
-        int undefended = move_iter->undefended & (1ull << move_iter->moves[i].square2) ? -material_table[move_iter->moves[i].piece] : 0;
-        if (check_move) {
-            move_iter->scores[i] = SORTPHASE6 + history_score + undefended;
-            move_iter->sorted_count += 1;
-            continue;
-        }
-        move_iter->scores[i] = SORTPHASE7 + history_score + see + undefended;
-        move_iter->sorted_count += 1;
     }
+    move_iter->stage_end = n;
 }
 
-static int sorted_move_iterator_next(struct sorted_move_iterator* move_iter, struct board* board, char who, move_t * table_move) {
+static int sorted_move_iterator_next(struct sorted_move_iterator* move_iter, struct search_ctx* ctx, char who) {
     move_iter->idx += 1;
     if (move_iter->idx >= move_iter->end) {
         return 0;
     }
-    if (move_iter->idx == 0 && table_move->piece != -1) {
-        move_iter->move = table_move;
-        return 1;
+    while (move_iter->idx >= move_iter->stage_end) {
+        sorted_move_iterator_next_stage(move_iter, ctx, who);
     }
 
     int besti = move_iter->idx;
-    if (!move_iter->finished_tablemove) {
-        if (table_move->piece != -1) {
-            for (int i = 1; i < move_iter->end; i++) {
-                if (move_equal(*table_move, move_iter->moves[i])) {
-                    move_t tm;
-                    move_copy(&tm, &move_iter->moves[i]);
-                    move_copy(&move_iter->moves[i], &move_iter->moves[0]);
-                    move_copy(&move_iter->moves[0], &tm);
-                    break;
-                }
-            }
-            move_iter->sorted_count += 1;
-        }
-        sorted_move_iterator_score(move_iter, board, who, 0, move_iter->sorted_count);
-        move_iter->finished_tablemove = 1;
-    }
-    if (move_iter->idx >= move_iter->sorted_count) {
-        sorted_move_iterator_score(move_iter, board, who, 1, move_iter->sorted_count);
-    }
-    for (int i = move_iter->idx + 1; i < move_iter->end; i++) {
+    for (int i = move_iter->idx + 1; i < move_iter->stage_end; i++) {
         if (move_iter->scores[i] > move_iter->scores[besti]) {
             besti = i;
         }
     }
-
-    if (besti == move_iter->idx) {
-        move_iter->move = &move_iter->moves[besti];
-        return 1;
+    if (besti != move_iter->idx) {
+        sorted_move_iterator_swap(move_iter, besti, move_iter->idx);
     }
-
-    move_t tm;
-    move_copy(&tm, &move_iter->moves[besti]);
-    move_copy(&move_iter->moves[besti], &move_iter->moves[move_iter->idx]);
-    move_copy(&move_iter->moves[move_iter->idx], &tm);
-    int tmp;
-    tmp = move_iter->scores[besti];
-    move_iter->scores[besti] = move_iter->scores[move_iter->idx];
-    move_iter->scores[move_iter->idx] = tmp;
-
     move_iter->move = &move_iter->moves[move_iter->idx];
     return 1;
 }
 
-static void sorted_move_iterator_init(struct sorted_move_iterator* move_iter, struct board* board, char who, struct deltaset* set, move_t * tablemove, int depth) {
+/* The table move is the only move of the first stage, but only if it is legal:
+ * the transposition table entry might belong to another position with the same key.
+ * If it is not, table_move is marked invalid.
+ */
+static void sorted_move_iterator_init(struct sorted_move_iterator* move_iter, struct deltaset* set,
+        move_t* table_move, struct killer_slot* killers, move_t* counter_move, continuation_t** continuation) {
     move_iter->idx = -1;
     move_iter->move = NULL;
+    move_iter->killers = killers;
+    move_iter->counter_move.piece = -1;
+    if (counter_move)
+        move_copy(&move_iter->counter_move, counter_move);
+    move_iter->continuation[0] = continuation[0];
+    move_iter->continuation[1] = continuation[1];
     move_iter->moves = set->moves;
     move_iter->end = set->nmoves;
-    move_iter->sorted_count = 0;
-    move_iter->finished_tablemove = 0;
     move_iter->undefended = set->undefended_squares;
-    move_iter->depth = depth;
+    move_iter->pseudo = set->pseudo;
+    move_iter->stage = STAGE_TABLEMOVE;
+    move_iter->stage_end = 0;
+    if (table_move->piece == -1)
+        return;
+    for (int i = 0; i < move_iter->end; i++) {
+        if (move_equal(*table_move, move_iter->moves[i])) {
+            sorted_move_iterator_swap(move_iter, i, 0);
+            move_iter->stage_end = 1;
+            return;
+        }
+    }
+    table_move->piece = -1;
 }
 
 
-/* Same thing, except that here, we only assume capture moves */
-static void sort_deltaset_qsearch(struct board* board, char who, struct deltaset* set) {
-    int i;
-    int scores[256];
-
-    for (i = 0; i < set->nmoves; i++) {
-        scores[i] = move_see(board, &set->moves[i]);
+// Swaps the move with the best score among the moves from start to end to start
+static inline void pick_best_move(move_t* moves, int* scores, int start, int end) {
+    int besti = start;
+    for (int i = start + 1; i < end; i++) {
+        if (scores[i] > scores[besti])
+            besti = i;
+    }
+    if (besti != start) {
+        move_t tm;
+        move_copy(&tm, &moves[start]);
+        move_copy(&moves[start], &moves[besti]);
+        move_copy(&moves[besti], &tm);
+        int ts = scores[start];
+        scores[start] = scores[besti];
+        scores[besti] = ts;
     }
-
-    insertion_sort(set->moves, scores, 0, set->nmoves);
 }
 
-/* Transforms a mating score to its current context. For example, if we stored "mate on move 10"
- * in the table when we are searching for move 5, when we retrieve the entry when we are searching for move 7,
- * we want to change it to "mate on move */
-static int transform_checkmate(struct board* board, union transposition* trans) {
-    if (trans->metadata.score > CHECKMATE - 1200) {
-        return trans->metadata.score + trans->metadata.age - board->nmoves;
-    }
-    else if (trans->metadata.score < -CHECKMATE + 1200) {
-        return trans->metadata.score - trans->metadata.age + board->nmoves;
-    }
-    return trans->metadata.score;
+/* Called right after making a move, with the hash of the new position:
+ * the bucket probed by the child node is likely not in the cache for large tables,
+ * so start loading it (and the evaluation cache slots) while we do the rest of the work for the move.
+ */
+static inline void prefetch_position(struct search_ctx* ctx) {
+    ttable_prefetch(&ctx->shared->ttable, ctx->board.hash);
+    if (ctx->eval_cache)
+        prefetch_evaluation_cache(ctx->eval_cache, &ctx->board);
 }
 
-static int ttable_search(struct board* restrict board, int who, int depth, move_t* restrict best, move_t* restrict move,
-                         int* restrict alpha, int beta) {
-    union transposition * stored;
+/* Returns 0 if the entry of the position ends the search with the score in alpha.
+ * The stored move is returned in move, and the entry, with its score from the position, in entry
+ * (whose type is 0 if there is none).
+ * A search that leaves out a move (excluded) searches another tree than the one of the entry,
+ * so it only uses the move.
+ */
+static int ttable_search(struct search_ctx* ctx, int who, int depth, move_t* restrict best, move_t* restrict move,
+                         int* restrict alpha, int beta, move_t* excluded, struct transposition* entry) {
+    struct board* board = &ctx->board;
+    struct transposition stored;
+    move_t stored_move;
     int score;
     int ret = -1;
     move->piece = -1;
+    entry->type = 0;
     // TODO: do we need ply > 1?
-    if (ttable_read(board->hash, &stored) == 0 && position_count_table_read(board->hash) < 1) {
-        score = transform_checkmate(board, stored);
-        if (stored->metadata.depth >= depth / ONE_PLY) {
-            if ((stored->metadata.type & EXACT)) {
-                if (is_pseudo_valid_move(board, who, stored->move)) {
-                    move_copy(best, &stored->move);
-                    *alpha = score;
-                    return 0;
-                } else {
-                    char buffer[8];
-                    char board_buffer[128];
-                    move_to_calgebraic(board, buffer, &stored->move);
-                    board_to_fen(board, board_buffer);
-                    fprintf(stderr, "(0) Trying to apply invalid move (%s) on board: %s\n", buffer, board_buffer);
-                    return -2;
-                }
-            } 
+    if (ttable_read(ctx, board->hash, &stored) == 0 && position_count_table_read(ctx->shared->position_counts, board->hash) < 1) {
+        // The entry might belong to another position with the same key,
+        // in which case the stored move usually does not fit the board and we ignore it
+        int has_move = (stored.type & MOVESTORED) && ttable_unpack_move(board, who, stored.move, &stored_move) == 0;
+        score = score_from_ttable(board, stored.score);
+        *entry = stored;
+        entry->score = score;
+        if (stored.depth >= depth / ONE_PLY && excluded->piece == -1) {
+            if ((stored.type & EXACT) && has_move) {
+                move_copy(best, &stored_move);
+                *alpha = score;
+                return 0;
+            }
             // The stored score is only an upper bound,
             // so we can only terminate if score is less than the current lower bound
-            if ((stored->metadata.type & ALPHA_CUTOFF) && score <= *alpha) {
+            if ((stored.type & ALPHA_CUTOFF) && score <= *alpha) {
                 *alpha = score;
                 ret = 0;
             }
             // The stored score is only an lower bound,
             // so we can only terminate if score is greater than the current upper bound
-            if ((stored->metadata.type & BETA_CUTOFF) && score >= beta) {
+            if ((stored.type & BETA_CUTOFF) && score >= beta) {
                 *alpha = score;
                 ret = 0;
             }
-        } 
-        if (stored->metadata.type & MOVESTORED) {
-            if (is_pseudo_valid_move(board, who, stored->move)) {
-                move_copy(move, &stored->move);
-                return ret;
-            } else {
-                char buffer[8];
-                char board_buffer[128];
-                move_to_calgebraic(board, buffer, &stored->move);
-                board_to_fen(board, board_buffer);
-                fprintf(stderr, "enpassant: %llx, square2: %llx, eq: %d, piece: %d\n", board->enpassant, (1ull << stored->move.square2), board->enpassant == (1ull << stored->move.square2), stored->move.piece);
-                fprintf(stderr, "(1) Trying to apply invalid move (%s) on board: %s\n", buffer, board_buffer);
-                return -2;
-            }
+        }
+        if (has_move) {
+            move_copy(move, &stored_move);
         }
     }
     return ret;
 }
 
+// Returns 1 if the thread should abandon its search
+static int search_should_stop(struct search_ctx* ctx) {
+    ctx->time_check_nodes = TIME_CHECK_INTERVAL;
+    if (ctx->shared->stop || (ctx->id != 0 && ctx->shared->helpers_stop))
+        return 1;
+    if (ctx->id == 0 && ctx->shared->max_nodes) {
+        if ((uint64_t) ctx->branches >= ctx->shared->max_nodes)
+            return 1;
+        // Check again exactly when the node budget runs out
+        ctx->time_check_nodes = MIN(TIME_CHECK_INTERVAL, ctx->shared->max_nodes - ctx->branches);
+    }
+    return !timer_continue(ctx->timer);
+}
+
+// Counts a node and returns 1 if the thread should abandon its search.
+// The clock and the stop flags are only looked at every TIME_CHECK_INTERVAL nodes.
+static inline int search_time_check(struct search_ctx* ctx) {
+    if (--ctx->time_check_nodes > 0)
+        return 0;
+    return search_should_stop(ctx);
+}
+
 /* Quiescent search: a modified search routine that only considers captures.
  * This is necessary to avoid the horizon effect. Without qsearch, we might search 6 plies deep
  * and be happy about winning a pawn, but if we search 1 ply deeper, we find that we lose our queen!
@@ -467,8 +514,9 @@ static int ttable_search(struct board* restrict board, int who, int depth, move_
  * Despite pruning and the reduced branching factor, we spend most of our time in qsearch,
  * because it is called at every leaf node of the original search
  */
-int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int beta, char who) {
-    branches += 1;
+int qsearch(struct search_ctx* ctx, int depth, int alpha, int beta, char who) {
+    struct board* board = &ctx->board;
+    ctx->branches += 1;
     alpha = MAX(alpha, -CHECKMATE + board->nmoves);
     beta = MIN(beta, CHECKMATE - board->nmoves - 1);
     if (alpha >= beta) {
@@ -478,18 +526,17 @@ int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int
     struct deltaset out;
     int score = 0;
     int i = 0;
-    union transposition * stored;
 
     // Check if we are out of time. If so, abort
-    // Since clock() is costly, don't do this all the time!
-    if (branches % 65536 == 0) {
-        if (!timer_continue(timer) || signal_stop) {
-            out_of_time = 1;
-        }
+    if (search_time_check(ctx)) {
+        ctx->out_of_time = 1;
     }
 
     int nmoves = 0;
-    generate_qsearch_moves(&out, board);
+    if (ctx->flags & FLAGS_LEGAL_MOVEGEN)
+        generate_qsearch_moves(&out, board);
+    else
+        generate_pseudo_qsearch_moves(&out, board);
 
     struct deltaset out1;
 
@@ -501,9 +548,9 @@ int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int
     // and if not, using the static evaluation function
     if (nmoves == 0) {
         generate_moves(&out1, board);
-        score = board_score(board, who, &out1, alpha, beta);
+        score = board_score(board, who, &out1, alpha, beta, ctx->eval_cache);
     } else {
-        score = board_score(board, who, &out, alpha, beta);
+        score = board_score(board, who, &out, alpha, beta, ctx->eval_cache);
     }
     if (who) score = -score;
     int initial_score = score;
@@ -527,11 +574,16 @@ int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int
         return initial_score + 950;
     }
 
-    // sort_deltaset_qsearch(board, who, &out);
+    // Captures by MVV-LVA and capture history. The moves are picked one at a time,
+    // since most cutoffs happen on the first one
+    int scores[256];
+    for (i = 0; i < out.nmoves; i++)
+        scores[i] = capture_score(ctx, &out.moves[i], who);
 
     int value = 0;
     int delta_cutoff = 200;
     for (i = 0; i < out.nmoves; i++) {
+        pick_best_move(out.moves, scores, i, out.nmoves);
         // Delta-pruning for quiescent search:
         // If after we capture and don't allow the opponent to respond and we're still more than a minor piece
         // worse than alpha, this capture must really suck, so no need to consider it.
@@ -543,8 +595,17 @@ int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int
             continue;
         }
 
+        // With pseudo-legal moves, a position where none of the moves is legal is scored as a quiet position,
+        // which is only wrong in the rare stalemates where captures are available but illegal
+        if (out.pseudo && !is_legal(board, &out.moves[i])) {
+            continue;
+        }
+
         apply_move(board, &out.moves[i]);
-        score = -qsearch(board, timer, depth - ONE_PLY, -beta, -alpha, 1 - who);
+        // qsearch does not probe the transposition table, only the evaluation caches
+        if (ctx->eval_cache)
+            prefetch_evaluation_cache(ctx->eval_cache, board);
+        score = -qsearch(ctx, depth - ONE_PLY, -beta, -alpha, 1 - who);
         reverse_move(board, &out.moves[i]);
         if (alpha < score) {
             alpha = score;
@@ -558,6 +619,75 @@ int qsearch(struct board* board, struct timer* timer, int depth, int alpha, int
 
 int futility_margin[7] = {0, 100, 200, 300, 500, 900, 1200};
 
+/* Late move reductions grow with the log of the depth times the log of the move number:
+ * LMR_BASE + ln(depth) * ln(move number) * 100 / LMR_DIVISOR hundredths of a ply.
+ * A reduction then shrinks by LMR_PV in PV nodes and by a ply for every LMR_HISTORY of history,
+ * and grows by LMR_NOT_IMPROVING when the static evaluation is no better than two plies before,
+ * and by LMR_TT_CAPTURE when the table move is a capture (the quiet moves are then unlikely to be better).
+ * The coefficients are exposed to params.json, which rebuilds the table (see load_evaluation_params).
+ */
+#define LMR_MAX_DEPTH 64
+#define LMR_MAX_MOVES 64
+int LMR_BASE = 75;
+int LMR_DIVISOR = 225;
+int LMR_PV = 100;
+int LMR_HISTORY = 16384;
+int LMR_NOT_IMPROVING = 50;
+int LMR_TT_CAPTURE = 50;
+static int reductions[LMR_MAX_DEPTH][LMR_MAX_MOVES]; // In eighths of a ply, by depth in plies and move number
+
+void initialize_reductions() {
+    for (int d = 1; d < LMR_MAX_DEPTH; d++) {
+        for (int m = 1; m < LMR_MAX_MOVES; m++) {
+            double r = LMR_BASE + natural_log(d) * natural_log(m) * 10000 / LMR_DIVISOR;
+            reductions[d][m] = (int) (r * ONE_PLY / 100);
+        }
+    }
+}
+
+/* Pruning of quiet nodes near the leaves, from the static evaluation (parameters exposed to params.json as well):
+ * - Reverse futility: at depth RFP_DEPTH or less, a node whose evaluation beats beta by RFP_MARGIN per ply
+ *   (one ply less when it improves) is cut off, since the side to move is unlikely to fall below beta
+ * - Razoring: at depth RAZOR_DEPTH or less, a node whose evaluation is RAZOR_MARGIN per ply below alpha
+ *   is settled by qsearch when that confirms the fail low
+ * - Late move pruning: at depth LMP_DEPTH or less, the quiet moves after the first
+ *   (LMP_BASE + LMP_SCALE * depth^2 / 100) moves are not searched, and only half as many when not improving
+ */
+int RFP_DEPTH = 6;
+int RFP_MARGIN = 80;
+int RAZOR_DEPTH = 2;
+int RAZOR_MARGIN = 300;
+int LMP_DEPTH = 8;
+int LMP_BASE = 5;
+int LMP_SCALE = 150;
+
+// Number of moves searched in a node before its quiet moves are pruned
+static inline int lmp_count(int depth, int improving) {
+    int d = depth / ONE_PLY;
+    int count = LMP_BASE + LMP_SCALE * d * d / 100;
+    return improving ? count : count / 2;
+}
+
+// Reduction of the move_number-th move of a node, in eighths of a ply
+static inline int lmr_reduction(int depth, int move_number, int is_pv_node, int improving, int history, int tt_capture) {
+    int r = reductions[MIN(depth / ONE_PLY, LMR_MAX_DEPTH - 1)][MIN(move_number, LMR_MAX_MOVES - 1)];
+    if (is_pv_node)
+        r -= LMR_PV * ONE_PLY / 100;
+    if (!improving)
+        r += LMR_NOT_IMPROVING * ONE_PLY / 100;
+    if (tt_capture)
+        r += LMR_TT_CAPTURE * ONE_PLY / 100;
+    return r - history * ONE_PLY / LMR_HISTORY;
+}
+
+// The line of the node at ply is now move, followed by the line of its child
+static inline void update_pv(struct search_ctx* ctx, int ply, move_t* move) {
+    int length = MAX(ctx->pv_length[ply + 1], ply + 1);
+    ctx->pv[ply][ply] = *move;
+    memcpy(&ctx->pv[ply][ply + 1], &ctx->pv[ply + 1][ply + 1], (length - ply - 1) * sizeof(move_t));
+    ctx->pv_length[ply] = length;
+}
+
 /* The main search routine.
  * A negamax/pv-search routine.
  * The main gist of the algorithm is, at the given board position, generate all legal moves,
@@ -577,34 +707,50 @@ int futility_margin[7] = {0, 100, 200, 300, 500, 900, 1200};
  * we let the opponent move two times in a row, and if the resulting score is still very good for us,
  * that probably means our position to begin with is really good, so there is no need to search to deeper depth.
  * We also do more unsafe pruning such as futility pruning and late move reductions.
+ *
+ * Singular extensions: when the move of the transposition table is much better than all the others,
+ * it is probably forced (a recapture, the only defense against a threat), and worth a ply more.
+ * To find out, we search the node again without it (ss->excluded), at half depth and with a null window
+ * below the stored score. If every other move fails low, the table move is singular and extended.
+ * If the other moves fail high even against beta, several moves refute the previous move
+ * and we cut the node off at once (multi-cut).
  */
-int search(struct board* board, struct timer* timer, move_t* restrict best, move_t* restrict prev,
+static int search(struct search_ctx* ctx, move_t* restrict best, move_t* restrict prev,
         int depth, int alpha, int beta, int extensions, int nullmode, char who) {
+    struct board* board = &ctx->board;
+    int ply = ctx->ply;
+    struct stack_entry* ss = &ctx->stack[ply];
+    ctx->pv_length[ply] = ply;
 
     // Checkmate pruning: if we found a mate in n in another branch, and we are n+1 away from root,
     // no need to consider the current node
-    if (ply != 0) {
-        alpha = MAX(alpha, -CHECKMATE + board->nmoves);
-        beta = MIN(beta, CHECKMATE - board->nmoves - 1);
-        if (alpha >= beta) {
-            short_circuit_count++;
-            return alpha;
-        }
+    alpha = MAX(alpha, -CHECKMATE + board->nmoves);
+    beta = MIN(beta, CHECKMATE - board->nmoves - 1);
+    if (alpha >= beta) {
+        ctx->short_circuit_count++;
+        return alpha;
+    }
+
+    // The stack ends here: settle for the quiescent score
+    if (ply >= MAX_PLY - 1) {
+        best->piece = -1;
+        return qsearch(ctx, 32 * ONE_PLY, alpha, beta, who);
     }
 
     int is_pv_node = beta > alpha + 1;
     int orig_alpha = alpha;
 
     struct deltaset out;
-    union transposition transposition;
+    struct transposition transposition;
+    transposition.move = 0;
     move_t temp;
     int score = 0;
     int i = 0;
     int extended = 0;
     char pvariation = 1;
     int type = ALPHA_CUTOFF;
-    branches += 1;
-    main_branches += 1;
+    ctx->branches += 1;
+    ctx->main_branches += 1;
 
     // Mark it as invalid, in case we return prematurely (due to time limit)
     best->piece = -1; 
@@ -612,48 +758,56 @@ int search(struct board* board, struct timer* timer, move_t* restrict best, move
     // Detect cycles, which result in a drawn position
     int min_plies = MAX(0, ply - 2 * board->nmovesnocapture - 1);
     for (i = ply - 4; i >= min_plies; i -= 2) {
-        if (board->hash == seen[i]) {
-            short_circuit_count++;
+        if (board->hash == ctx->stack[i].hash) {
+            ctx->short_circuit_count++;
             return 0;
         }
     }
-    if (position_count_table_read(board->hash) >= 2 && ply > 0) {
-        short_circuit_count++;
+    if (position_count_table_read(ctx->shared->position_counts, board->hash) >= 2) {
+        ctx->short_circuit_count++;
         return 0;
     }
 
-    seen[ply] = board->hash;
-    ply++;
+    ss->hash = board->hash;
+    ctx->ply++;
 
     move_t tablemove;
     tablemove.piece = -1;
+    struct transposition entry;
+    int excluded = ss->excluded.piece != -1;
 
     // Look in the transposition table to see if we have seen the position before,
     // and if so, return the score if possible.
     // Even if we can't return the score due to lack of depth,
     // the stored move is probably good, so we can improve the pruning
-    int res = ttable_search(board, who, depth, best, &tablemove, &alpha, beta);
+    int res = ttable_search(ctx, who, depth, best, &tablemove, &alpha, beta, &ss->excluded, &entry);
     if (res == 0) {
-        ply--;
-        short_circuit_count++;
+        ctx->ply--;
+        ctx->short_circuit_count++;
+        // An exact entry ends the principal variation with its move
+        if (best->piece != -1) {
+            ctx->pv[ply][ply] = *best;
+            ctx->pv_length[ply] = ply + 1;
+        }
         return alpha;
     } else {
         alpha = orig_alpha;
     }
 
     // Check if we are out of time. If so, abort
-    // Since clock() is costly, don't do this all the time!
-    if (branches % 65536 == 0) {
-        // Check if we are out of time. If so, abort
-        if (!timer_continue(timer) || signal_stop) {
-            out_of_time = 1;
-            ply--;
-            return alpha;
-        }
+    if (search_time_check(ctx)) {
+        ctx->out_of_time = 1;
+        ctx->ply--;
+        return alpha;
     }
 
+    // With pseudo-legal moves, nmoves counts moves that might be illegal,
+    // which only makes the extensions and pruning based on the number of moves slightly less precise
     int nmoves = 0;
-    generate_moves(&out, board);
+    if (ctx->flags & FLAGS_LEGAL_MOVEGEN)
+        generate_moves(&out, board);
+    else
+        generate_pseudo_moves(&out, board);
     nmoves = out.nmoves;
 
     if (extensions > 0 && !nullmode) {
@@ -680,38 +834,64 @@ int search(struct board* board, struct timer* timer, move_t* restrict best, move
     // Terminal condition: no more moves are left, or we run out of depth
     if (depth < ONE_PLY || nmoves == 0) {
         if (nmoves == 0) {
-            score = board_score(board, who, &out, alpha, beta);
+            score = board_score(board, who, &out, alpha, beta, ctx->eval_cache);
             if (who) score = -score;
         } else {
-            score = qsearch(board, timer, 32 * ONE_PLY, alpha, beta, who);
+            score = qsearch(ctx, 32 * ONE_PLY, alpha, beta, who);
         }
-        ply--;
+        ctx->ply--;
         return score;
     }
 
-    initial_score = board_score(board, who, &out, alpha, beta);
+    initial_score = board_score(board, who, &out, alpha, beta, ctx->eval_cache);
     if (who) initial_score = -initial_score;
+    ss->static_eval = initial_score;
+    // The node at ply - 2 computed its static evaluation before searching its moves
+    int improving = ply < 3 || initial_score > ctx->stack[ply - 2].static_eval;
+
+    int static_pruning = !is_pv_node && !out.check && !excluded && !nullmode
+        && alpha > -CHECKMATE/2 && beta < CHECKMATE/2;
+    // Reverse futility pruning
+    if (static_pruning && depth <= RFP_DEPTH * ONE_PLY
+            && initial_score - RFP_MARGIN * (depth / ONE_PLY - improving) >= beta) {
+        ctx->ply--;
+        ctx->short_circuit_count++;
+        return initial_score;
+    }
+
+    // Razoring
+    if (static_pruning && depth <= RAZOR_DEPTH * ONE_PLY
+            && initial_score + RAZOR_MARGIN * (depth / ONE_PLY) < alpha) {
+        score = qsearch(ctx, 32 * ONE_PLY, alpha - 1, alpha, who);
+        if (score < alpha) {
+            ctx->ply--;
+            ctx->short_circuit_count++;
+            return score;
+        }
+    }
 
     // Null pruning:
     // If we skip a move, and the move is still bad for the oponent,
     // then our move must have been great
     // We check if we have at least 5 pieces. Otherwise, we might encounter zugzwang
     // TODO: ply > 1?
-    if (depth >= 2 * ONE_PLY && nullmode == 0 && !out.check &&
+    if (depth >= 2 * ONE_PLY && nullmode == 0 && !out.check && !excluded &&
             popcnt(board->pieces[who][KNIGHT] | board->pieces[who][BISHOP] | board->pieces[who][ROOK] | board->pieces[who][QUEEN]) >= 3) {
         uint64_t old_enpassant = board_flip_side(board, 1);
+        prefetch_position(ctx);
+        ss->move.piece = -1;
         int rdepth = depth - 3 * ONE_PLY - depth / 4;
-        score = -search(board, timer, &temp, NULL, rdepth, -beta, -beta + 1, 0, 1, 1 - who);
+        score = -search(ctx, &temp, NULL, rdepth, -beta, -beta + 1, 0, 1, 1 - who);
         if (score >= beta) {
-            ply--;
+            ctx->ply--;
             board_flip_side(board, old_enpassant);
             board->enpassant = old_enpassant;
-            short_circuit_count++;
+            ctx->short_circuit_count++;
             return score;
         } else {
             // Mate threat extension: if not doing anything allows opponents to checkmate us,
             // we are in a potentially dangerous situation, so extend search
-            score = search(board, timer, &temp, NULL, rdepth, CHECKMATE/2 - 1, CHECKMATE/2, 0, 1, 1 - who);
+            score = search(ctx, &temp, NULL, rdepth, CHECKMATE/2 - 1, CHECKMATE/2, 0, 1, 1 - who);
             board_flip_side(board, old_enpassant);
             board->enpassant = old_enpassant;
             if (score > CHECKMATE/2) {
@@ -723,18 +903,73 @@ int search(struct board* board, struct timer* timer, move_t* restrict best, move
     }
 
     // Internal iterative depening
-    if (is_pv_node && tablemove.piece == -1 && depth >= 6 * ONE_PLY && !nullmode) {
-        search(board, timer, &tablemove, prev, depth - depth / 4 - ONE_PLY, alpha, beta, 0, nullmode, who);
+    if (is_pv_node && tablemove.piece == -1 && depth >= 6 * ONE_PLY && !nullmode && !excluded) {
+        // Like the singular search, the reduced search of the node runs at the same ply
+        ctx->ply--;
+        search(ctx, &tablemove, prev, depth - depth / 4 - ONE_PLY, alpha, beta, 0, nullmode, who);
+        ctx->ply++;
+        ctx->pv_length[ply] = ply;
     }
 
     struct sorted_move_iterator iter;
-    sorted_move_iterator_init(&iter, board, who, &out, &tablemove, depth / ONE_PLY);
+    continuation_t* continuation[2] = {continuation_history(ctx, ply, 1, who), continuation_history(ctx, ply, 2, who)};
+    move_t* counter = counter_move(ctx, ply, who);
+    sorted_move_iterator_init(&iter, &out, &tablemove, &ss->killers, counter, continuation);
+
+    // Singular extension of the table move, which needs a lower bound of the node searched not much shallower.
+    // Extensions are limited to twice the depth of the iteration, so that chains of them end
+    int singular_extension = 0;
+    if (!excluded && depth >= 8 * ONE_PLY && ply < 2 * ctx->root_depth && tablemove.piece != -1
+            && (entry.type & (EXACT | BETA_CUTOFF)) && entry.depth >= depth / ONE_PLY - 3
+            && abs(entry.score) < CHECKMATE/2 && (!out.pseudo || is_legal(board, &tablemove))) {
+        int singular_beta = entry.score - 2 * depth / ONE_PLY;
+        // The search of the node without the table move runs at the same ply, on the same stack entry
+        ss->excluded = tablemove;
+        ctx->ply--;
+        score = search(ctx, &temp, prev, (depth - ONE_PLY) / 2, singular_beta - 1, singular_beta, 0, nullmode, who);
+        ctx->ply++;
+        ss->excluded.piece = -1;
+        ctx->pv_length[ply] = ply;
+        if (ctx->out_of_time) {
+            ctx->ply--;
+            return alpha;
+        }
+        if (score < singular_beta) {
+            singular_extension = ONE_PLY;
+        } else if (singular_beta >= beta) {
+            ctx->ply--;
+            ctx->short_circuit_count++;
+            return singular_beta;
+        }
+    }
+    // Quiet moves searched without a cutoff
+    move_t quiets[64];
+    int nquiets = 0;
+    move_t captures[32];
+    int ncaptures = 0;
 
     int allow_prune = !out.check && (nmoves > 6) && !extended;
     int checked_one_capture = 0;
+    int legal_moves = 0;
     for (i = 0; i < out.nmoves; i++) {
-        sorted_move_iterator_next(&iter, board, who, &tablemove);
+        sorted_move_iterator_next(&iter, ctx, who);
         move_t * move = iter.move;
+        if (excluded && move_equal(*move, ss->excluded)) {
+            continue;
+        }
+        if (out.pseudo && !is_legal(board, move)) {
+            continue;
+        }
+        legal_moves++;
+        // Late move pruning: the quiet moves come after the table move, the captures and the killers,
+        // so the ones left this late rarely matter. Quiet checks, which the iterator scores
+        // above PHASEGAP, are still searched
+        if (static_pruning && depth <= LMP_DEPTH * ONE_PLY && legal_moves > lmp_count(depth, improving)
+                && iter.stage == STAGE_QUIETS && !is_tactical(move) && iter.scores[iter.idx] < PHASEGAP / 2) {
+            continue;
+        }
+        // Only the table move, which comes first, can be singular
+        int new_depth = depth - ONE_PLY + (i == 0 ? singular_extension : 0);
         if (move->captured != -1 && depth <= 2 * ONE_PLY && allow_prune) {
             // Don't consider bad captures
             // TODO: what happens if we end up skipping all legal moves? Should it trigger alpha cutoff?
@@ -752,10 +987,10 @@ int search(struct board* board, struct timer* timer, move_t* restrict best, move
         // TODO: more agressive pruning. If ply>7 and depth<=20, also prune with delta_cutoff=500
         if (move->captured == -1 && move->promotion == move->piece && depth <= 6 * ONE_PLY
                 && alpha > -CHECKMATE/2 && beta < CHECKMATE/2 && allow_prune) {
-            if (!gives_check(board, board_occupancy(board, 1 - who) | board_occupancy(board, who), move, who)) {
-                if (initial_score + futility_margin[depth / ONE_PLY] < alpha) {
-                    continue;
-                }
+            // The margin is cheaper to test than whether the move gives check
+            if (initial_score + futility_margin[depth / ONE_PLY] < alpha
+                    && !gives_check(board, board_occupancy(board, 1 - who) | board_occupancy(board, who), move, who)) {
+                continue;
             }
         }
         // Late move reduction:
@@ -764,219 +999,626 @@ int search(struct board* board, struct timer* timer, move_t* restrict best, move
         // Hence, if the move is non-tactical and appears near the end,
         // it probably isn't as good, so we can search at reduced depth
 
+        ss->move = *move;
         apply_move(board, move);
+        prefetch_position(ctx);
         int skip_deep_search = 0;
-        int allow_lmr = allow_prune && depth >= 4 * ONE_PLY && (((i > 2 && !is_pv_node)) || (i >= 4 && move->captured == -1
+        int allow_lmr = allow_prune && depth >= 3 * ONE_PLY && (((i > 1 && !is_pv_node)) || (i >= 4 && move->captured == -1
                     && move->promotion == move->piece && alpha > -CHECKMATE/2 && beta < CHECKMATE/2));
         if (allow_lmr) {
             uint64_t occupancy = board_occupancy(board, 0) | board_occupancy(board, 1);
             uint64_t check_move = is_in_check(board, 1 - who, 0, occupancy);
-            if (!check_move) {
-                int reduction = ONE_PLY;
-                if (i > 8)
-                    reduction = 3 * ONE_PLY;
-                else if (i > 4)
-                    reduction = 2 * ONE_PLY;
-
-                /*
-                if (beta == alpha + 1) {
-                    reduction += ONE_PLY;
-                }
-                */
-                if (depth >= 8 * ONE_PLY) {
-                    reduction += ONE_PLY;
-                }
-
-                score = -search(board, timer, &temp, move, depth - ONE_PLY - reduction, -alpha - 1, -alpha, 0, nullmode, 1 - who);
+            int history = is_tactical(move) ? 0 : history_score(ctx, continuation, move, who);
+            int reduction = lmr_reduction(depth, i, is_pv_node, improving, history,
+                                          tablemove.piece != -1 && tablemove.captured != -1);
+            // The reduced search keeps at least a ply
+            reduction = MIN(reduction, depth - 2 * ONE_PLY);
+            if (!check_move && reduction > 0) {
+                score = -search(ctx, &temp, move, depth - ONE_PLY - reduction, -alpha - 1, -alpha, 0, nullmode, 1 - who);
 
                 if (score <= alpha) {
                     skip_deep_search = 1;
-                    alpha_cutoff_count += 1;
+                    ctx->alpha_cutoff_count += 1;
                 }
             }
         }
 
         if (!skip_deep_search) {
-            if (pvariation || ply == 1) {
-                score = -search(board, timer, &temp, move, depth - ONE_PLY, -beta, -alpha, extensions, nullmode, 1 - who);
+            if (pvariation) {
+                score = -search(ctx, &temp, move, new_depth, -beta, -alpha, extensions, nullmode, 1 - who);
             } else {
-                score = -search(board, timer, &temp, move, depth - ONE_PLY, -alpha - 1, -alpha, 0, nullmode, 1 - who);
-                if (!out_of_time && score > alpha && score < beta)
-                    score = -search(board, timer, &temp, move, depth - ONE_PLY, -beta, -alpha, extensions, nullmode, 1 - who);
+                score = -search(ctx, &temp, move, new_depth, -alpha - 1, -alpha, 0, nullmode, 1 - who);
+                if (!ctx->out_of_time && score > alpha && score < beta)
+                    score = -search(ctx, &temp, move, new_depth, -beta, -alpha, extensions, nullmode, 1 - who);
             }
         }
         reverse_move(board, move);
         if (alpha < score) {
             alpha = score;
             move_copy(best, move);
-            move_copy(&transposition.move, move);
+            update_pv(ctx, ply, move);
+            transposition.move = ttable_pack_move(move);
             type = EXACT | MOVESTORED;
             pvariation = 0;
         }
         if (beta <= alpha) {
-            beta_cutoff_count += 1;
+            ctx->beta_cutoff_count += 1;
             // TODO: Check if in null-pruning, in pv node? check is capture?
-            update_killer(ply, move, alpha);
-            history[who][move->square1][move->square2] += (depth / ONE_PLY) * (depth / ONE_PLY);
+            update_killer(&ss->killers, move, alpha);
+            // The moves tried before lose what the cutoff move gains: the quiet ones
+            // only to a quiet move, and the captures to any move
+            int bonus = history_bonus(depth);
+            if (!is_tactical(move)) {
+                history_update(ctx, continuation, move, who, bonus);
+                for (int k = 0; k < nquiets; k++)
+                    history_update(ctx, continuation, &quiets[k], who, -bonus);
+                if (counter)
+                    move_copy(counter, move);
+            } else if (move->captured != -1) {
+                capture_history_update(ctx, move, who, bonus);
+            }
+            for (int k = 0; k < ncaptures; k++)
+                capture_history_update(ctx, &captures[k], who, -bonus);
             type = BETA_CUTOFF | MOVESTORED;
             break;
         }
-        if (out_of_time) {
-            ply--;
+        if (!is_tactical(move) && nquiets < 64)
+            move_copy(&quiets[nquiets++], move);
+        else if (move->captured != -1 && ncaptures < 32)
+            move_copy(&captures[ncaptures++], move);
+        if (ctx->out_of_time) {
+            ctx->ply--;
             return alpha;
         }
     }
 
-    ply--;
-    if (out_of_time) {
+    ctx->ply--;
+    if (ctx->out_of_time) {
         return alpha;
     }
+    // None of the pseudo-legal moves is legal, and we are not in check: stalemate.
+    // Without the excluded move, the node fails low instead, which makes the excluded move singular
+    if (legal_moves == 0) {
+        return excluded ? alpha : 0;
+    }
+
+    assert(best->piece == -1 || ttable_pack_move(best) == transposition.move);
 
-    if (best->piece != -1) {
-        if (!move_equal(*best, transposition.move)) {
-            printf("%llx\n", *((uint64_t *) best));
-            printf("%llx\n", *((uint64_t *) &transposition.move));
-            assert(0);
+    // The search without the excluded move does not store its score, which is not the one of the position
+    if (!nullmode && !excluded) {
+        transposition.type = type;
+        transposition.score = score_to_ttable(board, alpha);
+        transposition.depth = depth / ONE_PLY;
+        ttable_update(ctx, board->hash, &transposition);
+    }
+    return alpha;
+}
+
+void search_ctx_init(struct search_ctx* ctx, struct search_shared* shared,
+        struct board* board, struct timer* timer, int id) {
+    memset(ctx, 0, sizeof(struct search_ctx));
+    ctx->shared = shared;
+    ctx->board = *board;
+    ctx->timer = timer;
+    ctx->id = id;
+    ctx->history = shared->histories ? &shared->histories[id] : NULL;
+    ctx->eval_cache = shared->eval_caches ? &shared->eval_caches[id] : NULL;
+    ctx->time_check_nodes = TIME_CHECK_INTERVAL;
+    for (int i = 0; i < MAX_PLY; i++)
+        ctx->stack[i].excluded.piece = -1;
+}
+
+/* Root move list
+ * The legal moves of the root are generated once per search. The first iteration searches them
+ * with the move of the transposition table first, then the captures by static exchange evaluation.
+ */
+static void root_moves_init(struct search_ctx* ctx) {
+    struct board* board = &ctx->board;
+    struct deltaset mvs;
+    struct transposition stored;
+    move_t tablemove;
+    int scores[256];
+    generate_moves(&mvs, board);
+    tablemove.piece = -1;
+    if (ttable_read(ctx, board->hash, &stored) == 0 && (stored.type & MOVESTORED))
+        ttable_unpack_move(board, board->who, stored.move, &tablemove);
+    for (int i = 0; i < mvs.nmoves; i++) {
+        move_t* move = &mvs.moves[i];
+        if (tablemove.piece != -1 && move_equal(*move, tablemove))
+            scores[i] = INFINITY;
+        else if (is_tactical(move))
+            scores[i] = move_see(board, move);
+        else
+            scores[i] = -PHASEGAP;
+    }
+    insertion_sort(mvs.moves, scores, 0, mvs.nmoves);
+    ctx->root_count = MIN(mvs.nmoves, MAX_ROOT_MOVES);
+    for (int i = 0; i < ctx->root_count; i++) {
+        struct root_move* rm = &ctx->root_moves[i];
+        rm->move = mvs.moves[i];
+        rm->score = rm->prev_score = -INFINITY;
+        rm->nodes = 0;
+        rm->pv[0] = mvs.moves[i];
+        rm->pv_length = 1;
+    }
+}
+
+/* Called after every iteration: the scores of the iteration become the previous scores,
+ * and the moves from first on are ordered by the number of nodes of their subtrees.
+ * The moves before first (the best move, or the MultiPV lines) stay in place.
+ */
+static void root_moves_next_iteration(struct search_ctx* ctx, int first) {
+    struct root_move* moves = ctx->root_moves;
+    for (int i = 0; i < ctx->root_count; i++)
+        moves[i].prev_score = moves[i].score;
+    for (int i = first + 1; i < ctx->root_count; i++) {
+        if (moves[i].nodes <= moves[i - 1].nodes)
+            continue;
+        struct root_move rm = moves[i];
+        int k;
+        for (k = i; k > first && moves[k - 1].nodes < rm.nodes; k--)
+            moves[k] = moves[k - 1];
+        moves[k] = rm;
+    }
+}
+
+/* Search of the root, over the root moves from first on (the moves before first are the MultiPV lines
+ * already found in the iteration).
+ * The root is never cut short by the transposition table or by null-move pruning,
+ * and every move is searched with the full window, so that the scores of the list are meaningful.
+ * The moves record the nodes of their subtrees and their principal variations,
+ * and the best move is moved to first, to be searched first by the next search of the root.
+ */
+static int search_root(struct search_ctx* ctx, int first, int depth, int alpha, int beta) {
+    struct board* board = &ctx->board;
+    struct stack_entry* ss = &ctx->stack[0];
+    char who = board->who;
+    struct transposition transposition;
+    continuation_t* no_continuation[2] = {NULL, NULL};
+    move_t temp;
+    int type = ALPHA_CUTOFF;
+    int best = -1;
+    uint64_t occupancy = board_occupancy(board, 0) | board_occupancy(board, 1);
+    int allow_lmr = !is_in_check(board, who, 0, occupancy) && ctx->root_count > 6 && depth >= 4 * ONE_PLY;
+    transposition.move = 0;
+    ctx->branches += 1;
+    ctx->main_branches += 1;
+
+    ss->hash = board->hash;
+    ctx->pv_length[0] = 0;
+    ctx->ply = 1;
+    ctx->root_depth = depth / ONE_PLY;
+    for (int i = first; i < ctx->root_count; i++) {
+        struct root_move* rm = &ctx->root_moves[i];
+        move_t* move = &rm->move;
+        uint64_t nodes = ctx->branches;
+        int score = 0;
+        int skip_deep_search = 0;
+        ss->move = *move;
+        apply_move(board, move);
+        prefetch_position(ctx);
+        // Late move reduction, as in search
+        if (allow_lmr && i - first >= 4 && !is_tactical(move) && alpha > -CHECKMATE/2 && beta < CHECKMATE/2) {
+            occupancy = board_occupancy(board, 0) | board_occupancy(board, 1);
+            int reduction = MIN(lmr_reduction(depth, i - first, 1, 1, 0, 0), depth - 2 * ONE_PLY);
+            if (!is_in_check(board, 1 - who, 0, occupancy) && reduction > 0) {
+                score = -search(ctx, &temp, move, depth - ONE_PLY - reduction, -alpha - 1, -alpha, 0, 0, 1 - who);
+                if (score <= alpha) {
+                    skip_deep_search = 1;
+                    ctx->alpha_cutoff_count += 1;
+                }
+            }
+        }
+        if (!skip_deep_search)
+            score = -search(ctx, &temp, move, depth - ONE_PLY, -beta, -alpha, 5 * ONE_PLY, 0, 1 - who);
+        reverse_move(board, move);
+        rm->nodes = ctx->branches - nodes;
+        // The score of an unfinished search means nothing
+        if (ctx->out_of_time)
+            break;
+        rm->score = score;
+        if (alpha < score) {
+            alpha = score;
+            best = i;
+            rm->pv[0] = *move;
+            rm->pv_length = MAX(ctx->pv_length[1], 1);
+            memcpy(&rm->pv[1], &ctx->pv[1][1], (rm->pv_length - 1) * sizeof(move_t));
+            transposition.move = ttable_pack_move(move);
+            type = EXACT | MOVESTORED;
+        }
+        if (beta <= alpha) {
+            ctx->beta_cutoff_count += 1;
+            if (!is_tactical(move))
+                history_update(ctx, no_continuation, move, who, history_bonus(depth));
+            type = BETA_CUTOFF | MOVESTORED;
+            break;
         }
     }
+    ctx->ply = 0;
 
-    if (!nullmode) {
-        transposition.metadata.type = type;
-        transposition.metadata.age = board->nmoves;
-        transposition.metadata.score = alpha;
-        transposition.metadata.depth = depth / ONE_PLY;
-        ttable_update(board->hash, &transposition);
+    if (best > first) {
+        struct root_move rm = ctx->root_moves[best];
+        memmove(&ctx->root_moves[first + 1], &ctx->root_moves[first], (best - first) * sizeof(struct root_move));
+        ctx->root_moves[first] = rm;
+    }
+    // With moves left out, the result does not describe the position
+    if (!ctx->out_of_time && first == 0) {
+        transposition.type = type;
+        transposition.score = score_to_ttable(board, alpha);
+        transposition.depth = depth / ONE_PLY;
+        ttable_update(ctx, board->hash, &transposition);
     }
     return alpha;
 }
 
-int prev_score[2];
+static int leeway_table[32] = {40, 40, 35, 35, 30, 30, 30, 30,
+    25, 25, 20, 20, 10, 10, 10, 10,
+    10, 10, 10, 10, 10, 10, 10, 10,
+    10, 10, 10, 10, 10, 10, 10, 10,
+};
 
-move_t find_best_move(struct board* board, struct timer* timer, char who, char flags, char infinite) {
-    signal_stop = 0;
-    out_of_time = 0;
-    int alpha, beta;
-    int d = 0, s;
-    move_t best, temp;
-    best.piece = -1;
-    clock_t start = clock();
-
-    alpha_cutoff_count = 0;
-    beta_cutoff_count = 0;
-    short_circuit_count = 0;
-    branches = 0;
-    main_branches = 0;
-
-    alpha = -INFINITY;
-    beta = INFINITY;
-
-    tt_hits = 0;
-    tt_tot = 0;
-    memset(killer, 0, sizeof(killer));
-
-    for (int w = 0; w < 2; w++) {
-        for (int sq1 = 0; sq1 < 64; sq1++) {
-            for (int sq2 = 0; sq2 < 64; sq2++) {
-                history[w][sq1][sq2] = 0;
-            }
+static int leeway(int depth) {
+    return leeway_table[MIN(MAX(depth / ONE_PLY, 0), 31)];
+}
+
+/* Aspirated search of the root: we hope that the score is between alpha and beta.
+ * If so, then we have greatly increased search speed.
+ * If not, we have to restart search with a wider window.
+ * The window is centered on prev_score, the score of the same line in the previous iteration.
+ * The best move ends up at first in the root move list (see search_root).
+ * Sets failed_low if the root failed low, and iteration_nodes to the nodes of the last search.
+ */
+static int aspiration_search(struct search_ctx* ctx, int first, int d, int prev_score,
+        int* failed_low, uint64_t* iteration_nodes) {
+    int alpha = prev_score - leeway(d - 6 * ONE_PLY);
+    int beta = prev_score + leeway(d - 6 * ONE_PLY);
+    int changea = leeway(d - ONE_PLY);
+    int changeb = leeway(d - ONE_PLY);
+    int s;
+    *failed_low = 0;
+    while (1) {
+        *iteration_nodes = ctx->branches;
+        s = search_root(ctx, first, d, alpha, beta);
+        *iteration_nodes = ctx->branches - *iteration_nodes;
+        if (ctx->out_of_time)
+            break;
+
+        if (s <= alpha) {
+            *failed_low = 1;
+            alpha = alpha - changea;
+            changea *= 4;
+        }
+        else if (s >= beta) {
+            beta = beta + changeb;
+            changeb *= 4;
+        } else {
+            break;
         }
     }
+    return s;
+}
+
+static void print_score(struct board* board, int s) {
+    printf("score ");
+    if (is_checkmate(s)) {
+        if (s > 0)
+            printf("mate %d ", (1 + CHECKMATE - s - board->nmoves)/2);
+        else
+            printf("mate -%d ", (1 + s + CHECKMATE - board->nmoves)/2);
+    }
+    else {
+        printf("cp %d ", s);
+    }
+}
 
-    static int leeway_table[32] = {40, 40, 35, 35, 30, 30, 30, 30,
-        25, 25, 20, 20, 10, 10, 10, 10,
-        10, 10, 10, 10, 10, 10, 10, 10,
-        10, 10, 10, 10, 10, 10, 10, 10,
-    };
+// Nodes searched so far by all the threads
+static uint64_t search_nodes(struct search_shared* shared) {
+    uint64_t nodes = 0;
+    for (int t = 0; t < shared->nctxs; t++)
+        nodes += shared->ctxs[t].branches;
+    return nodes;
+}
 
-    timer_start(timer);
+/* Prints the info line of a root move, with its principal variation.
+ * multipv is the number of the line, 0 when only one line is searched.
+ * A variation that ends with a cutoff of the transposition table is completed with the moves of the table,
+ * up to the depth of the iteration.
+ */
+static void print_info(struct search_ctx* ctx, int depth, int multipv, struct root_move* rm) {
+    struct board* board = &ctx->board;
+    uint64_t nodes = search_nodes(ctx->shared);
+    int64_t elapsed = timer_elapsed(ctx->timer);
+    struct transposition stored;
+    move_t line[MAX_PLY];
+    char buffer[8];
+    int i, length;
+    printf("info depth %d ", depth / ONE_PLY);
+    if (multipv)
+        printf("multipv %d ", multipv);
+    print_score(board, rm->score);
+    printf("nodes %llu nps %llu hashfull %d time %lld pv", (unsigned long long) nodes,
+            (unsigned long long) (nodes * 1000 / MAX(elapsed, 1)), ttable_hashfull(&ctx->shared->ttable),
+            (long long) elapsed);
+    for (length = 0; length < rm->pv_length; length++) {
+        line[length] = rm->pv[length];
+        move_to_algebraic(board, buffer, &line[length]);
+        printf(" %s", buffer);
+        apply_move(board, &line[length]);
+    }
+    while (length < MIN(depth / ONE_PLY, MAX_PLY) && ttable_read(ctx, board->hash, &stored) == 0
+            && (stored.type & MOVESTORED) && ttable_unpack_move(board, board->who, stored.move, &line[length]) == 0
+            && is_valid_move(board, board->who, line[length])) {
+        move_to_algebraic(board, buffer, &line[length]);
+        printf(" %s", buffer);
+        apply_move(board, &line[length]);
+        length++;
+    }
+    for (i = length - 1; i >= 0; i--)
+        reverse_move(board, &line[i]);
+    printf("\n");
+}
+
+/* Searches the extra MultiPV lines of an iteration, after the main search put the best move in front of the list.
+ * Line k is a search of the root moves from k on, which leaves out the moves of lines 0 to k-1.
+ * The first prev_lines lines were completed by the previous iteration, and the previous scores
+ * of their moves center aspiration windows; the others are searched with a full window.
+ * The transposition table holds what the earlier lines learned below the root, so the later lines are cheap.
+ * Returns the number of lines completed before running out of time.
+ */
+static int search_multipv_lines(struct search_ctx* ctx, int nlines, int d, int prev_lines) {
+    struct root_move* moves = ctx->root_moves;
+    int failed_low;
+    uint64_t nodes;
+    int k;
+    for (k = 1; k < nlines; k++) {
+        if (k < prev_lines)
+            aspiration_search(ctx, k, d, moves[k].prev_score, &failed_low, &nodes);
+        else
+            search_root(ctx, k, d, -INFINITY, INFINITY);
+        if (ctx->out_of_time)
+            break;
+    }
+    // Search instability can give a later line a better score: keep the lines after the first sorted.
+    // The first line stays in place, since it holds the move the search plays.
+    for (int i = 2; i < k; i++) {
+        if (moves[i].score <= moves[i - 1].score)
+            continue;
+        struct root_move line = moves[i];
+        int j;
+        for (j = i; j > 1 && moves[j - 1].score < line.score; j--)
+            moves[j] = moves[j - 1];
+        moves[j] = line;
+    }
+    return k;
+}
+
+/* Iterative deepening driver run by every search thread.
+ * Only the main thread (id 0) advises the timer and prints search information,
+ * and searches the extra lines of MultiPV.
+ * Helper threads start every other iteration one ply deeper,
+ * so that the threads do not all search the same tree in lockstep.
+ * Returns the score of the last completed iteration, and its depth in depth_reached.
+ */
+static int iterative_deepening(struct search_ctx* ctx, move_t* best_move, int* depth_reached) {
+    struct timer* timer = ctx->timer;
+    char flags = ctx->flags;
+    int d = 0, s;
+    int completed_depth = 4 * ONE_PLY;
+    int prev_score;
+    move_t best, temp;
 
     int maxdepth;
 
-    if (flags & FLAGS_DYNAMIC_DEPTH) {
+    if (ctx->shared->max_depth) {
+        maxdepth = (ctx->shared->max_depth + 1) * ONE_PLY;
+    } else if (flags & FLAGS_DYNAMIC_DEPTH) {
         maxdepth = 100 * ONE_PLY;
     } else {
         maxdepth = 10 * ONE_PLY;
     }
 
-    ply = 0;
+    root_moves_init(ctx);
+    // MultiPV: never ask for more lines than there are legal moves
+    int nlines = 1, lines_done = 1;
+    if (ctx->id == 0 && ctx->shared->multipv > 1) {
+        nlines = MIN(MIN(ctx->shared->multipv, MAX_MULTIPV), ctx->root_count);
+    }
+
     // A depth-4 search should always be accomplishable within the time limit
-    s = search(board, timer, &best, NULL, 4 * ONE_PLY, -INFINITY, INFINITY, 0, 0 /* null-mode */, who);
-    prev_score[who] = s;
-    temp = best;
+    s = search_root(ctx, 0, 4 * ONE_PLY, -INFINITY, INFINITY);
+    prev_score = s;
+    best = temp = ctx->root_moves[0].move;
+    root_moves_next_iteration(ctx, 1);
     // Iterative deepening
-    for (d = 6 * ONE_PLY; d < maxdepth; d += ONE_PLY) {
-        tt_hits = 0;
-        tt_tot = 0;
-        // Aspirated search: we hope that the score is between alpha and beta.
-        // If so, then we have greatly increased search speed.
-        // If not, we have to restart search
-        alpha = prev_score[who] - leeway_table[(d-6 * ONE_PLY)/ONE_PLY];
-        beta = prev_score[who] + leeway_table[(d-6 * ONE_PLY)/ONE_PLY];
-        int changea = leeway_table[(d-ONE_PLY)/ONE_PLY];
-        int changeb = leeway_table[(d-ONE_PLY)/ONE_PLY];
-        while (1) {
-            ply = 0;
-            s = search(board, timer, &best, NULL, d, alpha, beta, 5 * ONE_PLY, 0 /* null-mode */, who);
-            if (out_of_time)
-                break;
-
-            if (s <= alpha) {
-                alpha = alpha - changea;
-                changea *= 4;
-            }
-            else if (s >= beta) {
-                beta = beta + changeb;
-                changeb *= 4;
-            } else {
-                assert(best.piece != -1);
-                break;
-            }
-        }
-        if (out_of_time) {
-            if (best.piece == -1)
-                best = temp;
-            s = prev_score[who];
+    for (d = 6 * ONE_PLY + (ctx->id & 1) * ONE_PLY; d < maxdepth; d += ONE_PLY) {
+        int failed_low;
+        uint64_t iteration_nodes;
+        s = aspiration_search(ctx, 0, d, prev_score, &failed_low, &iteration_nodes);
+        // Even if the iteration was cut short, a move that completed with a better score
+        // than the previous best move was moved in front of the list
+        best = ctx->root_moves[0].move;
+        if (ctx->out_of_time) {
+            s = prev_score;
             break;
         }
         else {
-            prev_score[who] = s;
-            timer_advise(timer, !move_equal(temp, best));
+            if (nlines > 1) {
+                lines_done = search_multipv_lines(ctx, nlines, d, lines_done);
+            }
+            if (ctx->id == 0)
+                timer_advise(timer, !move_equal(temp, best), prev_score - s, failed_low,
+                        ctx->root_moves[0].nodes / (float) MAX(iteration_nodes, 1));
+            prev_score = s;
+            completed_depth = d;
             temp = best;
-            if (flags & FLAGS_UCI_MODE) {
-                printf("info depth %d ", d / ONE_PLY);
-                printf("score ");
-                if (is_checkmate(s)) {
-                    if (s > 0)
-                        printf("mate %d ", (1 + CHECKMATE - s - board->nmoves)/2);
-                    else
-                        printf("mate -%d ", (1 + s + CHECKMATE - board->nmoves)/2);
-                }
-                else {
-                    printf("cp %d ", s);
+            if (ctx->id == 0 && (flags & FLAGS_UCI_MODE)) {
+                if (nlines > 1) {
+                    for (int k = 0; k < lines_done; k++)
+                        print_info(ctx, d, k + 1, &ctx->root_moves[k]);
+                } else {
+                    print_info(ctx, d, 0, &ctx->root_moves[0]);
                 }
-                printf("time %lu pv", (clock() - start) * 1000 / CLOCKS_PER_SEC);
-                print_pv(board, d / ONE_PLY);
-                printf("\n");
             }
-            if (!infinite && is_checkmate(s)) {
+            root_moves_next_iteration(ctx, lines_done);
+            if (ctx->out_of_time) {
+                break;
+            }
+            if (!ctx->infinite && is_checkmate(s)) {
                 break;
             }
+            // Rather than start an iteration that would be abandoned halfway, move now
+            if (ctx->id == 0 && !timer_next_iteration(timer)) {
+                break;
+            }
+        }
+    }
+
+    *best_move = best;
+    *depth_reached = completed_depth;
+    return s;
+}
+
+// Finds the reply to the best move that the search expects, to ponder on.
+// The transposition table entry might belong to another position, so the move is checked against the legal moves.
+static void find_ponder_move(struct search_shared* shared, struct board* board, move_t* best, move_t* ponder) {
+    struct board copy = *board;
+    struct transposition stored;
+    struct deltaset mvs;
+    move_t move;
+    ponder->piece = -1;
+    apply_move(&copy, best);
+    if (ttable_probe(&shared->ttable, copy.hash, &stored) || !(stored.type & MOVESTORED) ||
+            ttable_unpack_move(&copy, copy.who, stored.move, &move))
+        return;
+    generate_moves(&mvs, &copy);
+    for (int i = 0; i < mvs.nmoves; i++) {
+        if (move_equal(mvs.moves[i], move)) {
+            *ponder = mvs.moves[i];
+            return;
+        }
+    }
+}
+
+static void* search_helper_thread(void* argument) {
+    struct search_ctx* ctx = (struct search_ctx*) argument;
+    move_t best;
+    int depth;
+    iterative_deepening(ctx, &best, &depth);
+    return NULL;
+}
+
+/* Lazy SMP: the main thread and shared->nthreads - 1 helper threads all search the root position
+ * independently, communicating only through the shared transposition table.
+ * The helpers fill the table with results that the main thread picks up,
+ * and the main thread alone decides the move.
+ */
+move_t find_best_move(struct search_shared* shared, struct board* board, struct timer* timer,
+        char who, char flags, char infinite) {
+    shared->helpers_stop = 0;
+    int d, s;
+    move_t best;
+    int nthreads = MAX(1, MIN(shared->nthreads, MAX_SEARCH_THREADS));
+    pthread_t helpers[MAX_SEARCH_THREADS];
+
+    struct search_ctx* ctxs = malloc(nthreads * sizeof(struct search_ctx));
+    assert(ctxs);
+    if (shared->nhistories < nthreads) {
+        free(shared->histories);
+        shared->histories = calloc(nthreads, sizeof(struct search_history));
+        assert(shared->histories);
+        shared->nhistories = nthreads;
+    }
+    if (shared->neval_caches < nthreads) {
+        free(shared->eval_caches);
+        shared->eval_caches = calloc(nthreads, sizeof(struct evaluation_cache));
+        assert(shared->eval_caches);
+        shared->neval_caches = nthreads;
+    }
+    for (int t = 0; t < nthreads; t++) {
+        search_ctx_init(&ctxs[t], shared, board, timer, t);
+        ctxs[t].flags = flags;
+        ctxs[t].infinite = infinite;
+    }
+
+    shared->ctxs = ctxs;
+    shared->nctxs = nthreads;
+    ttable_new_search(&shared->ttable);
+    timer_start(timer);
+
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&helpers[t], NULL, search_helper_thread, &ctxs[t])) {
+            nthreads = t;
+            break;
         }
     }
 
+    s = iterative_deepening(&ctxs[0], &best, &d);
+
+    shared->helpers_stop = 1;
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(helpers[t], NULL);
+    }
+
     assert(best.piece != -1);
 
+    struct search_ctx* ctx = &ctxs[0];
+    shared->nodes = 0;
+    for (int t = 0; t < nthreads; t++) {
+        shared->nodes += ctxs[t].branches;
+    }
+    shared->depth = d / ONE_PLY;
+    shared->tt_hits = ctx->tt_hits;
+    shared->tt_probes = ctx->tt_tot;
+    shared->stop_latency = shared->stop_time ? (int) (timer_now() - shared->stop_time) : -1;
+    find_ponder_move(shared, board, &best, &shared->ponder_move);
+
     char buffer[8];
     move_to_calgebraic(board, buffer, &best);
 
     fprintf(stderr, "Best scoring move is %s: %.2f\n", buffer, s/100.0);
-    fprintf(stderr, "Searched %d moves (%d main branches), #alpha: %d, #beta: %d, "
+    fprintf(stderr, "Searched %llu moves (%llu main branches), #alpha: %d, #beta: %d, "
                     "shorts: %d, depth: %d, TT hits: %.5f, Eval hits: %.5f, total table usage: %d (out of %d)\n",
-            branches, main_branches, alpha_cutoff_count, beta_cutoff_count, short_circuit_count, d / ONE_PLY,
-            tt_hits/((float) tt_tot), evaluation_cache_hits / ((float) evaluation_cache_calls), ttable_stored_count);
+            (unsigned long long) ctx->branches, (unsigned long long) ctx->main_branches, ctx->alpha_cutoff_count, ctx->beta_cutoff_count, ctx->short_circuit_count, d / ONE_PLY,
+            ctx->tt_hits/((float) ctx->tt_tot), ctx->eval_cache->hits / ((float) ctx->eval_cache->calls),
+            shared->ttable.stored_count, shared->ttable.size * TTABLE_BUCKET_SIZE);
+    if (nthreads > 1) {
+        fprintf(stderr, "Threads: %d, total nodes searched: %llu\n", nthreads, (unsigned long long) shared->nodes);
+    }
+    shared->ctxs = NULL;
+    shared->nctxs = 0;
+    free(ctxs);
     return best;
 }
 
-void search_stop() {
-    signal_stop = 1;
+void search_clear_history(struct search_shared* shared) {
+    free(shared->histories);
+    shared->histories = NULL;
+    shared->nhistories = 0;
+}
+
+void search_clear_evaluation_caches(struct search_shared* shared) {
+    for (int i = 0; i < shared->neval_caches; i++)
+        clear_evaluation_cache(&shared->eval_caches[i]);
+}
+
+void search_free(struct search_shared* shared) {
+    search_clear_history(shared);
+    free(shared->eval_caches);
+    shared->eval_caches = NULL;
+    shared->neval_caches = 0;
+}
+
+void search_ponderhit(struct search_shared* shared) {
+    shared->ponderhit = 1;
+}
+
+void search_stop(struct search_shared* shared) {
+    shared->stop_time = timer_now();
+    shared->stop = 1;
+}
+
+void search_prepare(struct search_shared* shared) {
+    shared->stop = 0;
+    shared->stop_time = 0;
+    shared->ponderhit = 0;
 }
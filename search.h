@@ -1,10 +1,173 @@
 #ifndef SEARCH_H
 #define SEARCH_H
 #include "board.h"
+#include "ttable.h"
 
-extern uint32_t history[2][64][64];
+#define MAX_SEARCH_THREADS 64
+#define MAX_MULTIPV 64
+// Iterative deepening goes to 100 plies at most, and extensions can take a line somewhat deeper.
+// Nodes at MAX_PLY - 1 plies from the root are not expanded, so the search never goes past MAX_PLY.
+#define MAX_PLY 128
+#define MAX_ROOT_MOVES 256
 
-move_t find_best_move(struct board* board, struct timer* timer, char who, char flags, char infinite);
-void search_stop();
+// Number of nodes a thread searches between two checks of the clock and the stop flags.
+// About a millisecond of search, which bounds both the overhead of the checks and the latency of a stop.
+#define TIME_CHECK_INTERVAL 1024
+
+/* State shared by all the threads searching on behalf of one engine:
+ * the transposition table, the repetition table of the game and the stop flags.
+ * Every engine owns its own, so engines in the same process never share search data.
+ */
+struct search_shared {
+    struct ttable ttable;
+    struct position_count* position_counts;
+    int nthreads;
+    volatile int stop; // Set by search_stop, cleared by search_prepare
+    volatile int64_t stop_time; // When search_stop was called (see timer_now), 0 if it was not
+    volatile int helpers_stop; // Set by the main thread when it is done, to stop the helper threads
+    volatile int ponderhit; // Set by search_ponderhit, cleared by search_prepare
+    int max_depth; // Depth (in plies) at which iterative deepening stops, 0 for the default
+    uint64_t max_nodes; // Number of nodes after which the main thread stops, 0 for no limit
+    int multipv; // Number of best lines the main thread searches and reports
+
+    // Statistics of the last search
+    uint64_t nodes; // Total number of nodes searched by all threads
+    int depth; // Depth reached by the main thread
+    uint64_t tt_hits; // Transposition table hits and probes of the main thread
+    uint64_t tt_probes;
+    int stop_latency; // Milliseconds from search_stop to the end of the search, -1 if search_stop was not called
+    move_t ponder_move; // Expected reply to the best move, read from the transposition table (piece is -1 if unknown)
+    struct search_ctx* ctxs; // The contexts of the search threads while a search runs, to count their nodes
+    int nctxs;
+    struct search_history* histories; // One per search thread, allocated by the first search
+    int nhistories;
+    struct evaluation_cache* eval_caches; // One per search thread, allocated by the first search
+    int neval_caches;
+};
+
+// Bound of the history scores
+#define HISTORY_MAX 16384
+
+// History of the moves that follow a given move, by piece (WHITEPAWN, ..., BLACKKING) and destination
+typedef int16_t continuation_t[12][64];
+
+/* Statistics of quiet moves that caused cutoffs, used to order the quiet moves.
+ * Every search thread has its own, kept from one search to the next within a game,
+ * since the positions of a game have much in common.
+ */
+struct search_history {
+    int16_t history[2][64][64]; // By side, from and to square
+    // By the piece and destination of the previous move (1 or 2 plies before), then of the move
+    continuation_t continuation[12][64];
+    move_t counter_moves[12][64]; // Quiet move that refuted the previous move, by its piece and destination
+    int16_t capture_history[12][64][6]; // By piece (WHITEPAWN, ..., BLACKKING), destination and captured piece
+};
+
+struct killer_slot {
+    move_t mate_killer;
+    move_t m1;
+    move_t m2;
+};
+
+/* Search state of one ply of a thread, indexed by the distance to the root.
+ * Moves excluded from a search are only needed at the root (for MultiPV),
+ * where the root move list keeps the lines already found in front of the moves left to search.
+ */
+struct stack_entry {
+    uint64_t hash; // Of the position at this ply, for repetition detection
+    move_t move; // Move being searched from the position
+    struct killer_slot killers;
+    int static_eval; // Evaluation of the position, from the side to move, if it was computed
+    move_t excluded; // Move left out by the singular extension search of this node, piece is -1 if none
+};
+
+/* A move of the root, kept from one iteration to the next.
+ * The moves are searched in the order of the list: the best move first,
+ * then the others by the number of nodes of their subtrees in the last iteration,
+ * since a move that took long to refute is likely to be the next best one.
+ */
+struct root_move {
+    move_t move;
+    int score; // Score of the last search of the move (only a bound unless it was the best move)
+    int prev_score; // Score at the end of the previous iteration
+    uint64_t nodes; // Nodes of the subtree of the move in the last search of the root
+    int pv_length;
+    move_t pv[MAX_PLY]; // Principal variation starting with the move, as of the last time it raised alpha
+};
+
+/* State owned by a single search thread.
+ * With Lazy SMP, every thread searches the same root position on its own copy
+ * of the board, with its own killers, history and statistics.
+ * The only data shared between the threads is held in the search_shared struct.
+ */
+struct search_ctx {
+    struct search_shared* shared;
+    struct board board;
+    struct timer* timer;
+    int id; // 0 is the main thread, which reports the search and picks the move
+    int ply;
+    int root_depth; // Depth of the current iteration, in plies
+    int out_of_time;
+    int time_check_nodes; // Nodes left before the next call to search_should_stop
+    char flags;
+    char infinite;
+
+    struct root_move root_moves[MAX_ROOT_MOVES];
+    int root_count;
+    struct stack_entry stack[MAX_PLY];
+    /* Triangular principal variation table: pv[ply] holds the best line found from the node at ply,
+     * from pv[ply][ply] to pv[ply][pv_length[ply] - 1]. A node builds its line from the line of its child.
+     */
+    move_t pv[MAX_PLY][MAX_PLY];
+    int pv_length[MAX_PLY];
+    struct search_history* history;
+    struct evaluation_cache* eval_cache; // NULL when the context does not belong to a search
+
+    // Statistics
+    uint64_t tt_hits;
+    uint64_t tt_tot;
+    int alpha_cutoff_count;
+    int beta_cutoff_count;
+    int short_circuit_count;
+    uint64_t branches;
+    uint64_t main_branches;
+};
+
+// Late move reduction parameters (see search.c), and the table built from them
+extern int LMR_BASE;
+extern int LMR_DIVISOR;
+extern int LMR_PV;
+extern int LMR_HISTORY;
+extern int LMR_NOT_IMPROVING;
+extern int LMR_TT_CAPTURE;
+// Reverse futility pruning, razoring and late move pruning parameters (see search.c)
+extern int RFP_DEPTH;
+extern int RFP_MARGIN;
+extern int RAZOR_DEPTH;
+extern int RAZOR_MARGIN;
+extern int LMP_DEPTH;
+extern int LMP_BASE;
+extern int LMP_SCALE;
+void initialize_reductions();
+
+void search_ctx_init(struct search_ctx* ctx, struct search_shared* shared,
+        struct board* board, struct timer* timer, int id);
+int qsearch(struct search_ctx* ctx, int depth, int alpha, int beta, char who);
+move_t find_best_move(struct search_shared* shared, struct board* board, struct timer* timer,
+        char who, char flags, char infinite);
+void search_stop(struct search_shared* shared);
+/* Clears the stop and ponderhit flags for the next search.
+ * It is not done by find_best_move: when the search runs on its own thread, the caller clears the flags
+ * before starting the thread, so that a stop sent right after the search starts is not lost.
+ */
+void search_prepare(struct search_shared* shared);
+// Turns a pondering search (see the ponderhit field of struct timer) into a timed search
+void search_ponderhit(struct search_shared* shared);
+// Forgets the move ordering statistics kept from the previous searches, for a new game
+void search_clear_history(struct search_shared* shared);
+// Empties the evaluation caches of the search threads
+void search_clear_evaluation_caches(struct search_shared* shared);
+// Releases the memory kept from one search to the next
+void search_free(struct search_shared* shared);
 
 #endif
@@ -7,56 +7,86 @@
 struct timer * new_timer(time_t wtime, time_t btime, time_t winc, time_t binc, int movestogo, int who) {
     struct timer * timer = malloc(sizeof(struct timer));
     if (!who) {
-        timer->time = wtime * CLOCKS_PER_SEC / 1000;
-        timer->inc = winc * CLOCKS_PER_SEC / 1000;
+        timer->time = wtime;
+        timer->inc = winc;
     } else {
-        timer->time = btime * CLOCKS_PER_SEC / 1000;
-        timer->inc = binc * CLOCKS_PER_SEC / 1000;
+        timer->time = btime;
+        timer->inc = binc;
     }
 
     timer->movestogo = movestogo;
     timer->start = 0;
     if (movestogo) {
-        timer->allotted_time = timer->time / movestogo;
+        timer->optimum_time = timer->time / movestogo;
         timer->max_time = MIN(2 * timer->time / movestogo, timer->time / MIN(2, movestogo));
-        timer->increment = 1.1;
     } else {
-        timer->allotted_time = timer->time / 25;
-        timer->max_time = timer->time / 12;
-        timer->increment = 1.1;
+        timer->optimum_time = timer->time / 25 + 3 * timer->inc / 4;
+        timer->max_time = timer->time / 8 + timer->inc;
     }
+    // Keep a margin for the communication with the interface, and never plan on more than the clock holds
+    timer->max_time = MAX(0, MIN(timer->max_time, timer->time - 50));
+    timer->optimum_time = MIN(timer->optimum_time, timer->max_time);
+    timer->allotted_time = timer->optimum_time;
+    timer->stability = 0;
     timer->infinite = 0;
+    timer->ponderhit = NULL;
     return timer;
 }
 
 struct timer * new_infinite_timer() {
     struct timer* timer = new_timer(86400000, 86400000, 0, 0, 1, 0);
-    timer->increment = 1;
     timer->infinite = 1;
     return timer;
 }
 
+int64_t timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void timer_start(struct timer* timer) {
-    timer->start = clock();
+    timer->start = timer_now();
+}
+
+int64_t timer_elapsed(struct timer * timer) {
+    return timer_now() - timer->start;
+}
+
+// Returns 1 while the search has no time limit
+static int timer_unlimited(struct timer * timer) {
+    return timer->infinite || (timer->ponderhit && !*timer->ponderhit);
 }
 
 int timer_continue(struct timer * timer) {
-    if (timer->infinite) return 1;
-    time_t now = clock();
-    if (now > timer->start + timer->allotted_time) {
+    if (timer_unlimited(timer)) return 1;
+    if (timer_elapsed(timer) > timer->allotted_time) {
         return 0;
     }
     return 1;
 }
 
-// Award increments if there is large fluctuation,
-// deduct increments if there is little fluctuation
-void timer_advise(struct timer * timer, int move_changed) {
-    if (move_changed)
-        timer->allotted_time = MIN(timer->max_time, timer->allotted_time * timer->increment * timer->increment);
-    /*
-    else
-        timer->allotted_time = MIN(timer->max_time, timer->allotted_time / timer->increment);
-    */
+void timer_advise(struct timer * timer, int move_changed, int score_drop, int failed_low, float best_move_effort) {
+    if (timer->infinite) return;
+    timer->stability = move_changed ? 0 : timer->stability + 1;
+
+    // A new best move calls for confirmation, and every iteration that keeps it makes it more trustworthy
+    float scale = move_changed ? 1.6 : MAX(0.6, 1.1 - 0.1 * timer->stability);
+    // A falling score means trouble: spend up to twice the time to look for a way out.
+    // A rising one is left alone.
+    scale *= 1 + MIN(MAX(score_drop, 0), 100) / 100.0;
+    if (failed_low)
+        scale *= 1.3;
+    // If the best move took nearly all the nodes, the alternatives were refuted quickly
+    scale *= MIN(MAX(1.6 - best_move_effort, 0.7), 1.4);
+
+    timer->allotted_time = MIN(timer->max_time, (int64_t) (timer->optimum_time * scale));
+}
+
+int timer_next_iteration(struct timer * timer) {
+    if (timer_unlimited(timer)) return 1;
+    // An iteration takes a few times as long as the previous ones together:
+    // past half of the time, the next one would most likely be cut short and wasted
+    return timer_elapsed(timer) < timer->allotted_time / 2;
 }
 
@@ -1,31 +1,52 @@
 #ifndef TIMEC_H
 #define TIMEC_H
 
+#include <stdint.h>
 #include <time.h>
 
-// Struct governing time control
+// Struct governing time control. All times are in milliseconds of wall-clock time.
 struct timer {
-    time_t time;
-    time_t inc;
+    int64_t time;
+    int64_t inc;
     int movestogo;
-    time_t start;
-    int allotted_time;
-    int max_time;
-    float increment;
+    int64_t start;
+    int64_t optimum_time; // Time for a move of average difficulty
+    int64_t allotted_time; // optimum_time scaled by the difficulty of the move, see timer_advise
+    int64_t max_time; // allotted_time never goes above this
+    int stability; // Number of iterations in a row that kept the best move
     int infinite;
+    // When pondering, the flag set on ponderhit: the timer has no limit until then (NULL if not pondering).
+    // The time is still counted from timer_start, so that the time spent pondering is saved on the clock.
+    volatile int* ponderhit;
 };
 
 struct timer * new_timer(time_t wtime, time_t btime, time_t winc, time_t binc, int movestogo, int who);
 
 struct timer * new_infinite_timer();
 
+// Milliseconds on the monotonic clock, which counts elapsed time whatever the number of busy threads
+int64_t timer_now();
+
 // Starts the timer
 void timer_start(struct timer * timer);
 
+// Milliseconds since the timer was started
+int64_t timer_elapsed(struct timer * timer);
+
 // Returns 1 if the engine should continue calculation
 int timer_continue(struct timer * timer);
 
-// Advises the time manager about the difficulty of a move
-void timer_advise(struct timer * timer, int move_changed);
+/* Advises the time manager about the difficulty of a move after every iteration.
+ * move_changed: the best move differs from the previous iteration
+ * score_drop: how much the score fell since the previous iteration, in centipawns (negative if it rose)
+ * failed_low: the root search failed low at least once during the iteration
+ * best_move_effort: fraction of the nodes of the iteration spent on the best move
+ * Unstable moves, falling scores, fail-lows and nodes spread over many moves extend the time of the move,
+ * a stable best move that takes most of the nodes shortens it.
+ */
+void timer_advise(struct timer * timer, int move_changed, int score_drop, int failed_low, float best_move_effort);
+
+// Returns 1 if there is enough time left to start another iteration
+int timer_next_iteration(struct timer * timer);
 
 #endif
@@ -0,0 +1,404 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "pieces.h"
+#include "ttable.h"
+#include "util.h"
+
+/* Lockless transposition table.
+ * All the search threads probe and store into the table without taking any lock.
+ * Every entry is a single 64-bit word which is read and written atomically,
+ * so a thread never sees half of an entry written by another thread.
+ */
+
+#define ENTRY_KEY(e) ((uint16_t) (e))
+#define ENTRY_MOVE(e) ((uint16_t) ((e) >> 16))
+#define ENTRY_SCORE(e) ((int16_t) ((e) >> 32))
+#define ENTRY_DEPTH(e) ((uint8_t) ((e) >> 48))
+#define ENTRY_BOUND(e) (((e) >> 56) & 3)
+#define ENTRY_GENERATION(e) ((e) >> 58)
+
+#define HASH_KEY(hash) ((uint16_t) (hash))
+#define GENERATION_MASK 63
+
+// Maps the transposition types to the 2 bit bound and back
+static const uint8_t type_to_bound[8] = {0, 1, 2, 0, 3, 0, 0, 0};
+static const uint8_t bound_to_type[4] = {0, ALPHA_CUTOFF, BETA_CUTOFF, EXACT};
+
+static inline uint64_t entry_pack(uint16_t key, struct transposition* t, uint8_t generation) {
+    return (uint64_t) key
+        | ((uint64_t) t->move << 16)
+        | ((uint64_t) (uint16_t) t->score << 32)
+        | ((uint64_t) t->depth << 48)
+        | ((uint64_t) type_to_bound[t->type & (ALPHA_CUTOFF | BETA_CUTOFF | EXACT)] << 56)
+        | ((uint64_t) (generation & GENERATION_MASK) << 58);
+}
+
+static inline void entry_unpack(uint64_t e, struct transposition* t) {
+    t->move = ENTRY_MOVE(e);
+    t->score = ENTRY_SCORE(e);
+    t->depth = ENTRY_DEPTH(e);
+    t->type = bound_to_type[ENTRY_BOUND(e)] | (t->move ? MOVESTORED : 0);
+}
+
+/* Allocation
+ * A multi-GB table probed at random addresses misses the TLB on almost every probe with 4 KB pages.
+ * On Linux, we map the table ourselves so that it can be backed by 2 MB pages:
+ * explicit huge pages (MAP_HUGETLB) if the administrator reserved some (vm.nr_hugepages),
+ * and transparent huge pages (madvise(MADV_HUGEPAGE)) otherwise.
+ * The table can also be interleaved over the NUMA nodes, so that the search threads
+ * on all the sockets share the memory bandwidth evenly.
+ * Clearing is done by several threads, since a single thread takes seconds on large tables.
+ */
+
+#define HUGE_PAGE_SIZE (2ull * 1024 * 1024)
+// Tables smaller than this are cleared by a single thread
+#define PARALLEL_CLEAR_SIZE (16ull * 1024 * 1024)
+
+#ifdef __linux__
+#define MPOL_INTERLEAVE_POLICY 3 // MPOL_INTERLEAVE in <numaif.h>, which is part of libnuma
+
+// Returns 1 if the memory policy could not be set (the table then stays on the default policy)
+static int numa_interleave(void* memory, size_t size) {
+#ifdef SYS_mbind
+    // All nodes; the kernel restricts the mask to the nodes we are allowed to use
+    unsigned long nodemask[4];
+    memset(nodemask, 0xff, sizeof(nodemask));
+    return syscall(SYS_mbind, memory, size, MPOL_INTERLEAVE_POLICY, nodemask, 8 * sizeof(nodemask), 0) != 0;
+#else
+    return 1;
+#endif
+}
+
+// Records how the table is backed in mapped_size, huge_pages and interleaved
+static void* map_table(struct ttable* table, size_t size, int flags) {
+    void* memory = MAP_FAILED;
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    if (flags & TTABLE_HUGE_PAGES) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        table->huge_pages = memory != MAP_FAILED;
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        // Transparent huge pages need a 2 MB aligned range: map one extra huge page and trim the ends
+        char* base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        char* aligned = (char*) (((uintptr_t) base + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > base)
+            munmap(base, aligned - base);
+        if (aligned + size < base + size + HUGE_PAGE_SIZE)
+            munmap(aligned + size, base + HUGE_PAGE_SIZE - aligned);
+        memory = aligned;
+#ifdef MADV_HUGEPAGE
+        // The kernel may still back parts of the range with small pages
+        if (flags & TTABLE_HUGE_PAGES)
+            table->huge_pages = madvise(memory, size, MADV_HUGEPAGE) == 0;
+#endif
+    }
+    if (flags & TTABLE_NUMA_INTERLEAVE)
+        table->interleaved = !numa_interleave(memory, size);
+    table->mapped_size = size;
+    return memory;
+}
+#endif
+
+static struct ttable_bucket* allocate_table(struct ttable* table, size_t size, int flags) {
+    void* memory;
+#ifdef __linux__
+    if (flags & (TTABLE_HUGE_PAGES | TTABLE_NUMA_INTERLEAVE)) {
+        memory = map_table(table, size, flags);
+        if (memory)
+            return memory;
+    }
+#endif
+    if (posix_memalign(&memory, 64, size))
+        return NULL;
+    return memory;
+}
+
+static void free_table(void* memory, size_t mapped_size) {
+    if (mapped_size)
+        munmap(memory, mapped_size);
+    else
+        free(memory);
+}
+
+struct clear_range {
+    char* start;
+    size_t size;
+};
+
+static void* clear_thread(void* argument) {
+    struct clear_range* range = (struct clear_range*) argument;
+    memset(range->start, 0, range->size);
+    return NULL;
+}
+
+static void clear_buckets(struct ttable_bucket* buckets, size_t size, int nthreads) {
+    pthread_t threads[64];
+    struct clear_range ranges[64];
+    nthreads = MAX(1, MIN(nthreads, 64));
+    if (size < PARALLEL_CLEAR_SIZE)
+        nthreads = 1;
+    // Chunks are multiples of the huge page size, so that every page is touched by a single thread
+    size_t chunk = ((size / nthreads) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    int started[64] = {0};
+    for (int i = 0; i < nthreads && (size_t) i * chunk < size; i++) {
+        ranges[i].start = (char*) buckets + i * chunk;
+        ranges[i].size = MIN(chunk, size - i * chunk);
+        // The calling thread clears the first chunk, and any chunk we could not start a thread for
+        if (i == 0 || pthread_create(&threads[i], NULL, clear_thread, &ranges[i]))
+            clear_thread(&ranges[i]);
+        else
+            started[i] = 1;
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+int ttable_init(struct ttable* table, int size, int flags, int nthreads) {
+    // The old table goes first, so that resizing a large table does not need room for both
+    ttable_free(table);
+    table->flags = flags;
+    struct ttable_bucket* buckets = allocate_table(table, size * sizeof(struct ttable_bucket), flags);
+    if (!buckets) {
+        return 1;
+    }
+    clear_buckets(buckets, size * sizeof(struct ttable_bucket), nthreads);
+    table->memory = buckets;
+    table->buckets = buckets;
+    table->size = size;
+    table->stored_count = 0;
+    table->generation = 0;
+    return 0;
+}
+
+void ttable_free(struct ttable* table) {
+    if (table->memory)
+        free_table(table->memory, table->mapped_size);
+    table->memory = NULL;
+    table->buckets = NULL;
+    table->size = 0;
+    table->mapped_size = 0;
+    table->huge_pages = 0;
+    table->interleaved = 0;
+}
+
+/* Saving and loading
+ * A saved table is a header followed by the buckets, exactly as they are in memory.
+ * The header is padded to a page, so that the buckets of a mapped file are aligned.
+ * Loading maps the file privately (copy on write): pages are read from disk as the search
+ * probes them, so a large table is usable immediately, and the file is never modified.
+ * The stored keys and moves are only meaningful with the same Zobrist hash codes,
+ * so the header records the seed and a fingerprint of the codes.
+ */
+
+#define TTABLE_FILE_MAGIC "ACETTBL\0"
+#define TTABLE_FILE_VERSION 1
+#define TTABLE_FILE_HEADER_SIZE 4096
+
+struct ttable_file_header {
+    char magic[8];
+    uint64_t version;
+    uint64_t zobrist_seed;
+    uint64_t zobrist_fingerprint;
+    uint64_t size; // Number of buckets
+    uint64_t bucket_size; // sizeof(struct ttable_bucket)
+    uint64_t generation;
+};
+
+int ttable_save(struct ttable* table, const char* path, uint64_t zobrist_seed, uint64_t zobrist_fingerprint) {
+    char header[TTABLE_FILE_HEADER_SIZE] = {0};
+    struct ttable_file_header* h = (struct ttable_file_header*) header;
+    memcpy(h->magic, TTABLE_FILE_MAGIC, sizeof(h->magic));
+    h->version = TTABLE_FILE_VERSION;
+    h->zobrist_seed = zobrist_seed;
+    h->zobrist_fingerprint = zobrist_fingerprint;
+    h->size = table->size;
+    h->bucket_size = sizeof(struct ttable_bucket);
+    h->generation = table->generation;
+
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return 1;
+    int failed = fwrite(header, sizeof(header), 1, f) != 1
+        || fwrite(table->buckets, sizeof(struct ttable_bucket), table->size, f) != (size_t) table->size;
+    failed |= fclose(f) != 0;
+    return failed;
+}
+
+int ttable_load(struct ttable* table, const char* path, uint64_t zobrist_seed, uint64_t zobrist_fingerprint) {
+    struct ttable_file_header h;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        close(fd);
+        return 1;
+    }
+    if (memcmp(h.magic, TTABLE_FILE_MAGIC, sizeof(h.magic)) || h.version != TTABLE_FILE_VERSION
+            || h.zobrist_seed != zobrist_seed || h.zobrist_fingerprint != zobrist_fingerprint
+            || h.bucket_size != sizeof(struct ttable_bucket) || h.size < 1 || h.size > INT_MAX
+            || (uint64_t) st.st_size != TTABLE_FILE_HEADER_SIZE + h.size * h.bucket_size) {
+        close(fd);
+        return 1;
+    }
+    size_t mapped_size = st.st_size;
+    char* memory = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        return 1;
+    // A mapping of the file, in small pages and on the default memory policy
+    ttable_free(table);
+    table->memory = memory;
+    table->buckets = (struct ttable_bucket*) (memory + TTABLE_FILE_HEADER_SIZE);
+    table->size = h.size;
+    table->stored_count = 0;
+    table->generation = h.generation & GENERATION_MASK;
+    table->mapped_size = mapped_size;
+    table->huge_pages = 0;
+    table->interleaved = 0;
+    return 0;
+}
+
+void ttable_clear(struct ttable* table, int nthreads) {
+    clear_buckets(table->buckets, table->size * sizeof(struct ttable_bucket), nthreads);
+    table->stored_count = 0;
+    table->generation = 0;
+}
+
+void ttable_new_search(struct ttable* table) {
+    table->generation = (table->generation + 1) & GENERATION_MASK;
+}
+
+// Depth (in plies) by which an update for the same position may be shallower than the entry it replaces
+#define SAME_KEY_DEPTH_MARGIN 3
+
+/* Replacement scheme: an entry for the same position is overwritten, unless it is much deeper
+ * than the update and of the current search, and the update is not exact (so that a shallow
+ * result of a reduced or null window search does not replace a deep one).
+ * An update without a move keeps the move of the entry for the same position.
+ * Otherwise, empty entries are filled, then we replace the entry of least worth,
+ * where entries lose worth with every search since they were stored, and gain worth with depth.
+ */
+void ttable_store(struct ttable* table, uint64_t hash, struct transposition* update) {
+    uint64_t* entries = ttable_bucket(table, hash)->entries;
+    uint16_t key = HASH_KEY(hash);
+    uint8_t generation = table->generation;
+    int victim = 0;
+    int victim_worth = INT_MAX;
+    for (int i = 0; i < TTABLE_BUCKET_SIZE; i++) {
+        uint64_t e = __atomic_load_n(&entries[i], __ATOMIC_RELAXED);
+        if (!ENTRY_BOUND(e)) {
+            table->stored_count++;
+            victim = i;
+            break;
+        }
+        if (ENTRY_KEY(e) == key) {
+            if (!(update->type & EXACT) && ENTRY_GENERATION(e) == generation
+                    && update->depth + SAME_KEY_DEPTH_MARGIN < ENTRY_DEPTH(e))
+                return;
+            if (!(update->type & MOVESTORED) && ENTRY_MOVE(e)) {
+                struct transposition t = *update;
+                t.move = ENTRY_MOVE(e);
+                t.type |= MOVESTORED;
+                __atomic_store_n(&entries[i], entry_pack(key, &t, generation), __ATOMIC_RELAXED);
+                return;
+            }
+            victim = i;
+            break;
+        }
+        int age = (generation - ENTRY_GENERATION(e)) & GENERATION_MASK;
+        int worth = ENTRY_DEPTH(e) - 8 * age;
+        if (worth < victim_worth) {
+            victim_worth = worth;
+            victim = i;
+        }
+    }
+    __atomic_store_n(&entries[victim], entry_pack(key, update, generation), __ATOMIC_RELAXED);
+}
+
+int ttable_probe(struct ttable* table, uint64_t hash, struct transposition* value) {
+    uint64_t* entries = ttable_bucket(table, hash)->entries;
+    uint16_t key = HASH_KEY(hash);
+    for (int i = 0; i < TTABLE_BUCKET_SIZE; i++) {
+        uint64_t e = __atomic_load_n(&entries[i], __ATOMIC_RELAXED);
+        if (ENTRY_KEY(e) == key && ENTRY_BOUND(e)) {
+            entry_unpack(e, value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int ttable_hashfull(struct ttable* table) {
+    int nbuckets = MIN(table->size, 1000 / TTABLE_BUCKET_SIZE);
+    int used = 0;
+    for (int i = 0; i < nbuckets; i++) {
+        for (int j = 0; j < TTABLE_BUCKET_SIZE; j++) {
+            uint64_t e = __atomic_load_n(&table->buckets[i].entries[j], __ATOMIC_RELAXED);
+            if (ENTRY_BOUND(e) && ENTRY_GENERATION(e) == table->generation)
+                used++;
+        }
+    }
+    return nbuckets ? used * 1000 / (nbuckets * TTABLE_BUCKET_SIZE) : 0;
+}
+
+uint16_t ttable_pack_move(move_t* move) {
+    int promotion = move->promotion != move->piece ? move->promotion : 0;
+    return move->square1 | (move->square2 << 6) | (promotion << 12);
+}
+
+int ttable_unpack_move(struct board* board, side_t who, uint16_t packed, move_t* move) {
+    int square1 = packed & 0x3f;
+    int square2 = (packed >> 6) & 0x3f;
+    int promotion = packed >> 12;
+    if (!packed || square1 == square2) return -1;
+
+    char piece1 = get_piece_on_square(board, square1);
+    if (piece1 == -1 || piece1 / 6 != who) return -1;
+    char piece2 = get_piece_on_square(board, square2);
+    if (piece2 != -1 && piece2 / 6 == who) return -1;
+
+    move->square1 = square1;
+    move->square2 = square2;
+    move->piece = piece1 % 6;
+    move->captured = piece2 == -1 ? -1 : piece2 % 6;
+    move->promotion = promotion ? promotion : move->piece;
+    move->misc = 0;
+    move->cancastle = 0;
+    move->enpassant = 0;
+
+    if (move->piece == PAWN) {
+        int rank2 = square2 / 8;
+        if ((rank2 == 0 || rank2 == 7) != (promotion != 0))
+            return -1;
+        // En passant
+        if (piece2 == -1 && square1 % 8 != square2 % 8) {
+            move->captured = PAWN;
+            move->misc |= 0x40;
+        }
+    } else if (promotion) {
+        return -1;
+    }
+    if (move->piece == KING && (square1 % 8 - square2 % 8 > 1 || square2 % 8 - square1 % 8 > 1))
+        move->misc |= 0x80;
+
+    return is_pseudo_valid_move(board, who, *move) ? 0 : -1;
+}
@@ -0,0 +1,110 @@
+#ifndef TTABLE_H
+#define TTABLE_H
+
+#include "board.h"
+
+// Transposition types
+#define ALPHA_CUTOFF 1
+#define BETA_CUTOFF 2
+#define EXACT 4
+#define MOVESTORED 8
+
+/* A transposition, as stored to and read from the table.
+ * The move is packed into 16 bits (see ttable_pack_move).
+ * Mate scores must be relative to the position the transposition belongs to,
+ * since the same position can be reached at different points in the game.
+ */
+struct transposition {
+    uint16_t move; // 0 if no move is stored
+    int16_t score;
+    uint8_t depth;
+    uint8_t type; // ALPHA_CUTOFF, BETA_CUTOFF or EXACT, ored with MOVESTORED if a move is stored
+};
+
+/* Entries of the transposition table are packed into 8 bytes, so that they can be
+ * read and written atomically by the search threads without any locking:
+ *  bits  0-15: lower 16 bits of the Zobrist hash
+ *  bits 16-31: packed move
+ *  bits 32-47: score
+ *  bits 48-55: depth
+ *  bits 56-57: bound (ALPHA_CUTOFF, BETA_CUTOFF or EXACT), 0 if the entry is empty
+ *  bits 58-63: generation of the search that stored the entry
+ * Four entries make up a 32 byte bucket, so a bucket never straddles a cache line.
+ * The upper bits of the Zobrist hash select the bucket (see ttable.c).
+ */
+#define TTABLE_BUCKET_SIZE 4
+
+struct ttable_bucket {
+    uint64_t entries[TTABLE_BUCKET_SIZE];
+};
+
+// Allocation flags (only supported on Linux, ignored elsewhere)
+#define TTABLE_HUGE_PAGES 1 // Back the table with huge pages, to avoid TLB misses when probing
+#define TTABLE_NUMA_INTERLEAVE 2 // Spread the table over all NUMA nodes
+
+// Transposition table, shared by all the search threads of an engine
+struct ttable {
+    void* memory; // Start of the allocation, which holds the buckets
+    struct ttable_bucket* buckets;
+    int size; // Number of buckets
+    int stored_count; // Number of entries filled (only approximate when several threads store)
+    uint8_t generation; // Incremented at every search, to replace entries of old searches first
+    int flags; // Allocation flags asked for, used again when the table is reallocated
+    // What the table actually got:
+    size_t mapped_size; // Size of the mapping if the table was allocated with mmap or loaded from a file, 0 otherwise
+    int huge_pages; // 1 if the table was mapped with huge pages (or advised to use transparent huge pages)
+    int interleaved; // 1 if the table was interleaved over the NUMA nodes (TTABLE_NUMA_INTERLEAVE, and mbind succeeded)
+};
+
+// Allocates an empty table of size buckets, cleared by nthreads threads, in place of the current one,
+// which is freed first; returns 1 on failure, leaving no table (memory is NULL)
+int ttable_init(struct ttable* table, int size, int flags, int nthreads);
+void ttable_free(struct ttable* table);
+void ttable_clear(struct ttable* table, int nthreads);
+
+// Saves the table to a file, or replaces the table with a mapping of a saved file.
+// The Zobrist seed and fingerprint identify the hash codes, which must match when loading.
+// Return 1 on failure (leaving the table unchanged when loading).
+int ttable_save(struct ttable* table, const char* path, uint64_t zobrist_seed, uint64_t zobrist_fingerprint);
+int ttable_load(struct ttable* table, const char* path, uint64_t zobrist_seed, uint64_t zobrist_fingerprint);
+
+// Called at the start of every search
+void ttable_new_search(struct ttable* table);
+
+/* Maps the hash uniformly onto the buckets: the index is the upper 64 bits of hash * size.
+ * This allows any number of buckets (so that all the memory the user gives us is used)
+ * for the cost of a multiplication instead of a mask.
+ * The index depends on the upper bits of the hash, and the key stored in the entry on the lower bits.
+ */
+static inline struct ttable_bucket* ttable_bucket(struct ttable* table, uint64_t hash) {
+    return &table->buckets[(uint64_t) (((unsigned __int128) hash * (uint64_t) table->size) >> 64)];
+}
+
+/* Starts loading the bucket of the given hash into the cache without waiting for it.
+ * The search calls it as soon as a move is made, so that the memory access overlaps
+ * with the work done before the child node probes the table.
+ */
+static inline void ttable_prefetch(struct ttable* table, uint64_t hash) {
+    __builtin_prefetch(ttable_bucket(table, hash));
+}
+
+// Stores a transposition for the position with the given Zobrist hash
+void ttable_store(struct ttable* table, uint64_t hash, struct transposition* update);
+
+// Reads the transposition stored for the given hash into value.
+// Returns 0 on a hit and -1 on a miss.
+// Safe to call while other threads store into the table.
+int ttable_probe(struct ttable* table, uint64_t hash, struct transposition* value);
+
+// Permille of the table filled by the current search, estimated from the first thousand entries
+int ttable_hashfull(struct ttable* table);
+
+// Packs a move into 16 bits: the source square, the destination square and the promoted piece
+uint16_t ttable_pack_move(move_t* move);
+
+// Rebuilds a packed move using the pieces on the board.
+// Returns -1 if the packed move does not fit the board
+// (since only 16 bits of the hash are stored, the entry might belong to another position).
+int ttable_unpack_move(struct board* board, side_t who, uint16_t packed, move_t* move);
+
+#endif
@@ -0,0 +1,221 @@
+/* Transposition table stress test.
+ * Several threads store and probe random positions in a small table at the same time,
+ * so that entries are constantly overwritten while other threads read them.
+ * Every transposition is derived from its hash, so a hit can be checked:
+ * a hit whose contents differ from what was stored for that hash is a corrupted hit,
+ * which the search would see as a bogus score or an invalid move.
+ *
+ * With --latency, a single thread instead measures the time of a probe at a random address
+ * of a large table (4 GB unless --size is given), each probe depending on the result of the previous one.
+ * Run it with and without --no-huge-pages (and --numa) to compare the allocation paths.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ttable.h"
+#include "util.h"
+
+// Default sizes in buckets: a small table for the stress test, so that entries are overwritten,
+// and one much larger than the caches and the TLB reach for the latency test
+#define STRESS_SIZE 1024
+#define LATENCY_SIZE (1 << 27)
+
+static struct option long_options[] = {
+    {"threads",  required_argument, 0, 't'},
+    {"size",     required_argument, 0, 's'},
+    {"keys",     required_argument, 0, 'k'},
+    {"ops",      required_argument, 0, 'n'},
+    {"latency",  no_argument,       0, 'l'},
+    {"no-huge-pages", no_argument,  0, 'p'},
+    {"numa",     no_argument,       0, 'm'},
+    {0, 0, 0, 0}
+};
+
+struct worker {
+    pthread_t thread;
+    struct ttable* table;
+    uint64_t seed;
+    uint64_t keys;
+    uint64_t ops;
+    // Results
+    uint64_t probes;
+    uint64_t hits;
+    uint64_t corrupted;
+};
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// The i-th hash of the key set. The lower 16 bits (the stored key) are distinct for every hash,
+// so a hit for the wrong hash can only come from corruption.
+static uint64_t key_hash(uint64_t i) {
+    return (splitmix64(i) << 16) | (i + 1);
+}
+
+// The transposition stored for a given hash
+static void make_transposition(uint64_t hash, struct transposition* t) {
+    static const uint8_t types[3] = {ALPHA_CUTOFF, BETA_CUTOFF, EXACT};
+    uint64_t bits = splitmix64(hash);
+    t->move = 1 + bits % 0xffff;
+    t->score = (int16_t) (bits >> 16);
+    t->depth = (bits >> 32) & 0xff;
+    t->type = types[(bits >> 40) % 3] | MOVESTORED;
+}
+
+static void* worker_run(void* argument) {
+    struct worker* w = (struct worker*) argument;
+    uint64_t state = w->seed;
+    struct transposition t, expected;
+    for (uint64_t i = 0; i < w->ops; i++) {
+        state = splitmix64(state);
+        uint64_t hash = key_hash(state % w->keys);
+        if (state & (1ull << 63)) {
+            make_transposition(hash, &t);
+            ttable_store(w->table, hash, &t);
+        } else {
+            w->probes++;
+            if (ttable_probe(w->table, hash, &t) == 0) {
+                w->hits++;
+                make_transposition(hash, &expected);
+                if (memcmp(&t, &expected, sizeof(t)) != 0)
+                    w->corrupted++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static uint64_t wall_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static int run_latency(struct ttable* table, uint64_t ops) {
+    struct transposition t;
+    uint64_t hash = 1;
+    // Fill the table, so that probes read populated buckets
+    for (uint64_t i = 0; i < 4ull * table->size; i++) {
+        hash = splitmix64(hash);
+        make_transposition(hash, &t);
+        ttable_store(table, hash, &t);
+    }
+    uint64_t hits = 0;
+    uint64_t start = wall_time_ms();
+    for (uint64_t i = 0; i < ops; i++) {
+        t.score = 0;
+        int ret = ttable_probe(table, hash, &t);
+        hits += ret == 0;
+        // The next address depends on the result of this probe, so probes cannot overlap
+        hash = splitmix64(hash + t.score + ret);
+    }
+    uint64_t elapsed = MAX(wall_time_ms() - start, 1);
+    printf("Table: %llu MB, flags: %d, mapped: %s, huge pages: %s, interleaved: %s\n",
+           (unsigned long long) (table->size * sizeof(struct ttable_bucket) >> 20), table->flags,
+           table->mapped_size ? "yes" : "no", table->huge_pages ? "yes" : "no", table->interleaved ? "yes" : "no");
+    printf("Probes: %llu in %llu ms (%.1f ns per probe), hits: %llu\n", (unsigned long long) ops,
+           (unsigned long long) elapsed, elapsed * 1e6 / ops, (unsigned long long) hits);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    int threads = 8;
+    int size = 0;
+    uint64_t keys = 1 << 14;
+    uint64_t ops = 10000000;
+    int latency = 0;
+    int flags = TTABLE_HUGE_PAGES;
+    while (1) {
+        int option_index = 0;
+        c = getopt_long(argc, argv, "t:s:k:n:lpm", long_options, &option_index);
+
+        if (c == -1)
+            break;
+        switch (c) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            case 'k':
+                keys = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                ops = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                latency = 1;
+                break;
+            case 'p':
+                flags &= ~TTABLE_HUGE_PAGES;
+                break;
+            case 'm':
+                flags |= TTABLE_NUMA_INTERLEAVE;
+                break;
+            case '?':
+                break;
+
+            default:
+                abort ();
+          }
+    }
+    if (size == 0)
+        size = latency ? LATENCY_SIZE : STRESS_SIZE;
+    if (threads < 1 || size < 1 || keys < 1 || keys >= 0xffff) {
+        fprintf(stderr, "Invalid arguments: need threads >= 1, size >= 1 and 1 <= keys < 65535\n");
+        return 1;
+    }
+
+    struct ttable table = {0};
+    if (ttable_init(&table, size, flags, threads)) {
+        fprintf(stderr, "Could not allocate the transposition table\n");
+        return 1;
+    }
+    if ((flags & TTABLE_NUMA_INTERLEAVE) && !table.interleaved)
+        fprintf(stderr, "Could not interleave the transposition table over the NUMA nodes\n");
+    if (latency) {
+        run_latency(&table, ops);
+        ttable_free(&table);
+        return 0;
+    }
+    struct worker* workers = calloc(threads, sizeof(struct worker));
+    uint64_t start = wall_time_ms();
+    for (int i = 0; i < threads; i++) {
+        workers[i].table = &table;
+        workers[i].seed = splitmix64(i + 1);
+        workers[i].keys = keys;
+        workers[i].ops = ops;
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+            fprintf(stderr, "Could not create thread %d\n", i);
+            return 1;
+        }
+    }
+    uint64_t probes = 0, hits = 0, corrupted = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        probes += workers[i].probes;
+        hits += workers[i].hits;
+        corrupted += workers[i].corrupted;
+    }
+    uint64_t elapsed = wall_time_ms() - start;
+
+    printf("Threads: %d, table buckets: %d, keys: %llu\n", threads, size, (unsigned long long) keys);
+    printf("Operations: %llu in %llu ms (%.0f ops/sec)\n", (unsigned long long) (ops * threads),
+           (unsigned long long) elapsed, ops * threads / (elapsed / 1000.0 + 1e-9));
+    printf("Probes: %llu, hits: %llu, corrupted hits: %llu\n", (unsigned long long) probes,
+           (unsigned long long) hits, (unsigned long long) corrupted);
+    ttable_free(&table);
+    free(workers);
+    return corrupted != 0;
+}
@@ -36,7 +36,7 @@ int main(int argc, char* argv[]) {
     setbuf(stdout, NULL);
     setbuf(stdin, NULL);
     setlocale(LC_ALL, "en_US.UTF-8");
-    hashmapsize = 2048*8;
+    hashmapsize = 1;
     engine_init(0);
     while (getline(&buffer, &n, stdin) > 0) {
         char * token;
@@ -57,10 +57,8 @@ int main(int argc, char* argv[]) {
                 // int who = engine_get_who();
                 // if (who) score = -score;
                 printf("%d\n", score);
-                clear_evaluation_cache();
             } else if (strcmp(token, "load") == 0) {
                 load_evaluation_params();
-                clear_evaluation_cache();
             }
             token = strtok(NULL, " ");
         }
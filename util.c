@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "util.h"
 /* The state must be seeded so that it is not everywhere zero. */
 int p = 0;
@@ -34,3 +36,7 @@ void rand64_seed(uint64_t seed) {
     p = 0;
     rand64();
 }
+
+double natural_log(double x) {
+    return log(x);
+}
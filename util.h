@@ -28,4 +28,8 @@
 uint64_t rand64(void);
 void rand64_seed(uint64_t seed);
 
+// Natural logarithm, for the tables built at startup. math.h is kept out of the units
+// that include board.h, whose INFINITY would redefine the one of math.h
+double natural_log(double x);
+
 #endif